@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "n64_crc.h"
+#include "button_map.h"
+
+// threshold of the analog triggers used as buttons
+#define TRIGGER_THRESHOLD	512
+
+#define XPAD_BIT(b)		(__builtin_ctz(b))
+
+// the mapping of earlier firmware
+static const struct button_map_rule default_rules[] = {
+    { XPAD_BIT(XPAD_HAT_UP),    N64_BUTTON_D_UP,    0 },
+    { XPAD_BIT(XPAD_HAT_DOWN),  N64_BUTTON_D_DOWN,  0 },
+    { XPAD_BIT(XPAD_HAT_LEFT),  N64_BUTTON_D_LEFT,  0 },
+    { XPAD_BIT(XPAD_HAT_RIGHT), N64_BUTTON_D_RIGHT, 0 },
+
+    { XPAD_BIT(XPAD_PAD_LB),    N64_BUTTON_C_UP,    0 },
+    { XPAD_BIT(XPAD_PAD_RB),    N64_BUTTON_C_DOWN,  0 },
+    { BUTTON_MAP_AXIS_LT,       N64_BUTTON_C_LEFT,  TRIGGER_THRESHOLD },
+    { BUTTON_MAP_AXIS_RT,       N64_BUTTON_C_RIGHT, TRIGGER_THRESHOLD },
+
+    { XPAD_BIT(XPAD_PAD_A),     N64_BUTTON_A,       0 },
+    { XPAD_BIT(XPAD_PAD_B),     N64_BUTTON_B,       0 },
+    { XPAD_BIT(XPAD_PAD_X),     N64_BUTTON_Z,       0 },
+    { XPAD_BIT(XPAD_PAD_Y),     N64_BUTTON_START,   0 },
+    { XPAD_BIT(XPAD_STICK_L),   N64_BUTTON_L,       0 },
+
+    { XPAD_BIT(XPAD_START),     N64_BUTTON_START,   0 },
+};
+
+static const struct button_map_header *flash_map = (const struct button_map_header *) (XIP_BASE + BUTTON_MAP_OFFSET);
+
+// N64 buttons of every value of the low and the high byte of the gamepad buttons
+static uint16_t map_lo[256];
+static uint16_t map_hi[256];
+
+struct axis_rule {
+    uint8_t axis;
+    uint16_t button;
+    int16_t threshold;
+};
+
+static struct axis_rule axis_rules[BUTTON_MAP_RULES];
+static uint8_t axis_rule_count;
+
+static bool flash_map_valid(void)
+{
+    const uint8_t *p = (const uint8_t *) (flash_map + 1);
+    uint8_t crc = 0;
+
+    if (flash_map->magic != BUTTON_MAP_MAGIC || flash_map->count > BUTTON_MAP_RULES) {
+	return false;
+    }
+
+    for (int i = 0; i < flash_map->count * sizeof(struct button_map_rule); i++) {
+	crc = n64_crc_update(crc, p[i]);
+    }
+
+    return crc == flash_map->crc;
+}
+
+static void compile(const struct button_map_rule *rules, uint8_t count)
+{
+    memset(map_lo, 0, sizeof(map_lo));
+    memset(map_hi, 0, sizeof(map_hi));
+    axis_rule_count = 0;
+
+    for (int i = 0; i < count; i++) {
+	const struct button_map_rule *rule = &rules[i];
+	uint16_t button;
+
+	if (rule->source >= BUTTON_MAP_SOURCES || rule->button > N64_BUTTON_A) {
+	    printf("Bad button map rule %d\n", i);
+	    continue;
+	}
+
+	button = 1 << rule->button;
+
+	if (rule->source < 8) {
+	    for (int v = 0; v < 256; v++) {
+		if (v & (1 << rule->source)) {
+		    map_lo[v] |= button;
+		}
+	    }
+	} else if (rule->source < 16) {
+	    for (int v = 0; v < 256; v++) {
+		if (v & (1 << (rule->source - 8))) {
+		    map_hi[v] |= button;
+		}
+	    }
+	} else {
+	    axis_rules[axis_rule_count].axis = rule->source - BUTTON_MAP_AXIS_LX;
+	    axis_rules[axis_rule_count].button = button;
+	    axis_rules[axis_rule_count].threshold = rule->threshold;
+	    axis_rule_count++;
+	}
+    }
+}
+
+void button_map_init(void)
+{
+    if (flash_map_valid()) {
+	printf("Button map from flash, %d rules\n", flash_map->count);
+	compile((const struct button_map_rule *) (flash_map + 1), flash_map->count);
+    } else {
+	compile(default_rules, count_of(default_rules));
+    }
+}
+
+uint16_t button_map_apply(const xpad_controller_t *info)
+{
+    const int16_t axes[] = { info->lx, info->ly, info->rx, info->ry, info->lt, info->rt };
+    uint16_t buttons = map_lo[info->buttons & 0xFF] | map_hi[(info->buttons >> 8) & 0xFF];
+
+    for (int i = 0; i < axis_rule_count; i++) {
+	const struct axis_rule *rule = &axis_rules[i];
+	int16_t value = axes[rule->axis];
+
+	if (rule->threshold >= 0 ? value > rule->threshold : value < rule->threshold) {
+	    buttons |= rule->button;
+	}
+    }
+
+    return buttons;
+}
@@ -0,0 +1,74 @@
+#ifndef _BUTTON_MAP_H_
+#define _BUTTON_MAP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hardware/flash.h"
+#include "tusb.h"
+
+#include "pak_store.h"
+
+// Gamepad to N64 button mapping. The mapping is a list of rules kept in a
+// flash sector below the pak store (tools/button_map.py builds it, picotool
+// writes it), the built-in mapping is used when the sector holds none.
+// The rules are compiled at boot into OR-mask tables indexed by the low and
+// high byte of the gamepad buttons, plus a short list of axis thresholds.
+
+#define BUTTON_MAP_OFFSET	(PAK_STORE_OFFSET - FLASH_SECTOR_SIZE)
+
+#define BUTTON_MAP_MAGIC	0x50414D42 // "BMAP"
+#define BUTTON_MAP_RULES	64
+
+// Rule sources: the bit number of an xpad_pad_t button, or an axis that
+// counts as pressed above a positive threshold or below a negative one
+enum {
+    BUTTON_MAP_AXIS_LX = 16,
+    BUTTON_MAP_AXIS_LY,
+    BUTTON_MAP_AXIS_RX,
+    BUTTON_MAP_AXIS_RY,
+    BUTTON_MAP_AXIS_LT,
+    BUTTON_MAP_AXIS_RT,
+    BUTTON_MAP_SOURCES
+};
+
+// Rule targets: bit number in the N64 button word, first byte in the high bits
+enum {
+    N64_BUTTON_C_RIGHT = 0,
+    N64_BUTTON_C_LEFT,
+    N64_BUTTON_C_DOWN,
+    N64_BUTTON_C_UP,
+    N64_BUTTON_R,
+    N64_BUTTON_L,
+    N64_BUTTON_D_RIGHT = 8,
+    N64_BUTTON_D_LEFT,
+    N64_BUTTON_D_DOWN,
+    N64_BUTTON_D_UP,
+    N64_BUTTON_START,
+    N64_BUTTON_Z,
+    N64_BUTTON_B,
+    N64_BUTTON_A
+};
+
+// Flash layout, little endian: the header, then count rules. The CRC is the
+// N64 CRC-8 of the rules.
+struct button_map_header {
+    uint32_t magic;
+    uint8_t count;
+    uint8_t crc;
+    uint16_t reserved;
+};
+
+struct button_map_rule {
+    uint8_t source;
+    uint8_t button;
+    int16_t threshold;
+};
+
+// Load the mapping from flash, or the built-in one, and compile it
+void button_map_init(void);
+
+// N64 button word of a gamepad state
+uint16_t button_map_apply(const xpad_controller_t *info);
+
+#endif
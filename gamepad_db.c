@@ -0,0 +1,72 @@
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+
+#include "n64_crc.h"
+#include "gamepad_db.h"
+
+static const struct gamepad_db_header *db = (const struct gamepad_db_header *) (XIP_BASE + GAMEPAD_DB_OFFSET);
+static const uint16_t *db_seeds;
+static const struct gamepad_db_entry *db_entries;
+
+static bool db_valid;
+
+static uint32_t db_hash(uint32_t key, uint32_t seed)
+{
+    uint32_t h = (key ^ seed) * 0x9E3779B1;
+
+    return h ^ (h >> 15);
+}
+
+// hash scaled to 0..n-1 without a division
+static inline uint32_t db_index(uint32_t h, uint32_t n)
+{
+    return ((uint64_t) h * n) >> 32;
+}
+
+void gamepad_db_init(void)
+{
+    uint32_t size = db->buckets * sizeof(uint16_t) + db->count * sizeof(struct gamepad_db_entry);
+    const uint8_t *p = (const uint8_t *) (db + 1);
+    uint8_t crc = 0;
+
+    db_valid = false;
+
+    if (db->magic != GAMEPAD_DB_MAGIC || db->count == 0 || db->buckets == 0 ||
+	sizeof(*db) + size > GAMEPAD_DB_SIZE) {
+	return;
+    }
+
+    for (uint32_t i = 0; i < size; i++) {
+	crc = n64_crc_update(crc, p[i]);
+    }
+
+    if (crc != db->crc) {
+	printf("Gamepad database is damaged\n");
+	return;
+    }
+
+    db_seeds = (const uint16_t *) (db + 1);
+    db_entries = (const struct gamepad_db_entry *) (db_seeds + db->buckets);
+    db_valid = true;
+
+    printf("Gamepad database, %d gamepads\n", db->count);
+}
+
+const struct gamepad_db_entry *gamepad_db_find(uint16_t vid, uint16_t pid)
+{
+    uint32_t key = ((uint32_t) vid << 16) | pid;
+    const struct gamepad_db_entry *entry;
+
+    if (!db_valid) {
+	return NULL;
+    }
+
+    entry = &db_entries[db_index(db_hash(key, db_seeds[db_index(db_hash(key, 0), db->buckets)]), db->count)];
+
+    if (entry->vid != vid || entry->pid != pid) {
+	return NULL;
+    }
+
+    return entry;
+}
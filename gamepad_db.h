@@ -0,0 +1,82 @@
+#ifndef _GAMEPAD_DB_H_
+#define _GAMEPAD_DB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "button_map.h"
+
+// Layouts of generic HID gamepads by VID/PID, converted from SDL's
+// gamecontrollerdb.txt by tools/gamecontrollerdb.py and kept in flash below
+// the button map. A gamepad is found with a perfect hash: the key picks a
+// bucket, the seed of the bucket picks the entry.
+
+#define GAMEPAD_DB_SIZE		(128 * 1024)
+#define GAMEPAD_DB_OFFSET	(BUTTON_MAP_OFFSET - GAMEPAD_DB_SIZE)
+
+#define GAMEPAD_DB_MAGIC	0x42444347 // "GCDB"
+
+// controls of an entry
+enum {
+    GAMEPAD_LX,
+    GAMEPAD_LY,
+    GAMEPAD_RX,
+    GAMEPAD_RY,
+    GAMEPAD_LT,
+    GAMEPAD_RT,
+    GAMEPAD_A,
+    GAMEPAD_B,
+    GAMEPAD_X,
+    GAMEPAD_Y,
+    GAMEPAD_LB,
+    GAMEPAD_RB,
+    GAMEPAD_START,
+    GAMEPAD_BACK,
+    GAMEPAD_GUIDE,
+    GAMEPAD_L3,
+    GAMEPAD_R3,
+    GAMEPAD_DPAD_UP,
+    GAMEPAD_DPAD_DOWN,
+    GAMEPAD_DPAD_LEFT,
+    GAMEPAD_DPAD_RIGHT,
+    GAMEPAD_CONTROLS
+};
+
+// Where a control is in the report:
+// 0x00-0x3F: button n, the n-th usage of the button page
+// 0x40-0x7F: axis n (bits 0-3), the n-th of X, Y, Z, Rx, Ry, Rz, slider,
+//            dial and wheel in the report, with GAMEPAD_AXIS_* flags (bits 4-5)
+// 0x80-0xBF: hat n (bits 4-5) direction (bits 0-3: 1 up, 2 right, 4 down, 8 left)
+// 0xFF:      none
+#define GAMEPAD_BUTTON		0x00
+#define GAMEPAD_AXIS		0x40
+#define GAMEPAD_HAT		0x80
+#define GAMEPAD_NONE		0xFF
+
+#define GAMEPAD_AXIS_INVERT	0x10
+// only the positive half (the negative one when inverted)
+#define GAMEPAD_AXIS_HALF	0x20
+
+// Flash layout, little endian: the header, buckets 16-bit seeds, then count
+// entries. The CRC is the N64 CRC-8 of the seeds and the entries.
+struct gamepad_db_header {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t buckets;
+    uint8_t crc;
+    uint8_t reserved[3];
+};
+
+struct gamepad_db_entry {
+    uint16_t vid;
+    uint16_t pid;
+    uint8_t control[GAMEPAD_CONTROLS];
+} __attribute__((packed));
+
+// Check the database in flash
+void gamepad_db_init(void);
+
+// Layout of a gamepad, NULL if it is not in the database
+const struct gamepad_db_entry *gamepad_db_find(uint16_t vid, uint16_t pid);
+
+#endif
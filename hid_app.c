@@ -28,6 +28,7 @@
 
 #include "hid_parser.h"
 #include "hid_app.h"
+#include "gamepad_db.h"
 
 //--------------------------------------------------------------------+
 // MACRO TYPEDEF CONSTANT ENUM DECLARATION
@@ -35,14 +36,21 @@
 
 #define MAX_REPORT  4
 
+// Bits of the last report with one ID that the gamepad plan reads
+typedef struct {
+  uint16_t len;
+  uint8_t data[CFG_TUH_HID_EPIN_BUFSIZE];
+} report_cache_t;
+
 static uint16_t const keycode2randnet[256] =  { HID_KEYCODE_TO_RANDNET };
 
 // Each HID instance can has multiple reports
-static struct
+typedef struct
 {
   uint8_t report_count;
   hid_report_info_t report_info[MAX_REPORT];
-} hid_info[CFG_TUH_HID];
+  report_cache_t report_cache[MAX_REPORT];
+} hid_info_t;
 
 typedef struct {
     const hid_report_item_t *lx;
@@ -62,6 +70,19 @@ typedef struct {
     const hid_report_item_t *select;
     const hid_report_item_t *sl;
     const hid_report_item_t *sr;
+    // d-pad of gamepads without a hat switch (up, down, left, right), buttons
+    // or axes with GAMEPAD_AXIS in their flags
+    const hid_report_item_t *dpad[4];
+    uint8_t dpad_flags[4];
+    // hat directions (1 up, 2 right, 4 down, 8 left) of the d-pad
+    uint8_t hat_mask[4];
+    // GAMEPAD_AXIS_* flags of the sticks, triggers that are axes have GAMEPAD_AXIS too
+    uint8_t lx_flags;
+    uint8_t ly_flags;
+    uint8_t rx_flags;
+    uint8_t ry_flags;
+    uint8_t lt_flags;
+    uint8_t rt_flags;
 } gamepad_items_t;
 
 typedef struct {
@@ -76,25 +97,91 @@ typedef struct {
     const hid_report_item_t *fw;
 } mouse_items_t;
 
-static gamepad_items_t gamepad_items;
-static bool gamepad_inited;
+enum {
+    GAMEPAD_VALUE_LX,
+    GAMEPAD_VALUE_LY,
+    GAMEPAD_VALUE_RX,
+    GAMEPAD_VALUE_RY,
+    GAMEPAD_VALUE_LT,
+    GAMEPAD_VALUE_RT,
+    // d-pad directions on axes
+    GAMEPAD_VALUE_DPAD_UP,
+    GAMEPAD_VALUE_DPAD_DOWN,
+    GAMEPAD_VALUE_DPAD_LEFT,
+    GAMEPAD_VALUE_DPAD_RIGHT,
+    GAMEPAD_VALUE_HAT,
+    GAMEPAD_VALUES
+};
+
+enum {
+    MOUSE_VALUE_X,
+    MOUSE_VALUE_Y,
+    MOUSE_VALUE_WHEEL,
+    MOUSE_VALUE_ACPAN,
+    MOUSE_VALUES
+};
+
+// An axis centered and scaled to -32767..32767: (value - center) << shift,
+// then the GAMEPAD_AXIS_* flags. Triggers that are axes have GAMEPAD_AXIS.
+typedef struct {
+    int32_t center;
+    uint8_t shift;
+    uint8_t flags;
+} axis_scale_t;
+
+typedef struct {
+    extract_plan_t plan;
+    axis_scale_t axis[GAMEPAD_VALUE_HAT];
+    uint8_t hat_mask[4];
+    // bits of the report the ops read, reports that differ only
+    // elsewhere (counters, sensors, padding) are not decoded
+    uint8_t used[CFG_TUH_HID_EPIN_BUFSIZE];
+    uint16_t used_len;
+} gamepad_plan_t;
+
+// Parsed reports and decoder state of every device, indexed by dev_addr - 1
+typedef struct {
+    hid_info_t hid_info[CFG_TUH_HID];
+
+    gamepad_plan_t gamepad_plan;
+    // layout from the gamepad database, NULL to guess it
+    const struct gamepad_db_entry *gamepad_db;
+    bool gamepad_inited;
+    xpad_controller_t gamepad_old_info;
 
-static mouse_items_t mouse_items;
-static bool mouse_inited;
+    extract_plan_t mouse_plan;
+    bool mouse_inited;
 
-static bool keyboard_inited;
+    bool keyboard_inited;
+} hid_device_t;
 
-static void process_kbd_boot_report(hid_keyboard_report_t const *report);
-static void process_mouse_boot_report(hid_mouse_report_t const * report);
+static hid_device_t hid_devices[CFG_TUH_DEVICE_MAX];
+
+// d-pad directions in the order of the gamepad database
+static const uint16_t dpad_buttons[4] = { XPAD_HAT_UP, XPAD_HAT_DOWN, XPAD_HAT_LEFT, XPAD_HAT_RIGHT };
+static const uint8_t dpad_hat_mask[4] = { 0x01, 0x04, 0x08, 0x02 };
+
+// hat switch positions 0-7 (up, up right, ...) as directions
+static const uint8_t hat_directions[8] = { 0x01, 0x03, 0x02, 0x06, 0x04, 0x0C, 0x08, 0x09 };
+
+static inline hid_device_t *get_device(uint8_t dev_addr)
+{
+    return &hid_devices[dev_addr - 1];
+}
+
+static void process_kbd_boot_report(uint8_t dev_addr, hid_keyboard_report_t const *report);
+static void process_mouse_boot_report(uint8_t dev_addr, hid_mouse_report_t const * report);
 static void process_generic_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len);
 
-extern void enable_keyboard(void);
-extern void update_keys(uint16_t keys[3], bool error, bool home);
+extern void enable_keyboard(uint8_t dev_addr);
+extern void update_keys(uint8_t dev_addr, uint16_t keys[3], bool error, bool home);
+
+extern void enable_mouse(uint8_t dev_addr);
+extern void update_mouse(uint8_t dev_addr, uint8_t buttons, int32_t x, int32_t y, int8_t wheel, int8_t acpan);
 
-extern void enable_mouse(void);
-extern void update_mouse(uint8_t buttons, int8_t x, int8_t y, int8_t wheel, int8_t acpan);
+extern void enable_hid_gamepad(uint8_t dev_addr);
 
-extern void enable_hid_gamepad(void);
+extern void disable_input(uint8_t dev_addr);
 
 void hid_app_task(void)
 {
@@ -114,6 +201,19 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
 {
   printf("HID device address = %d, instance = %d is mounted\r\n", dev_addr, instance);
 
+  if (dev_addr > CFG_TUH_DEVICE_MAX || instance >= CFG_TUH_HID) {
+    return;
+  }
+
+  hid_device_t *dev = get_device(dev_addr);
+  uint16_t vid, pid;
+
+  tuh_vid_pid_get(dev_addr, &vid, &pid);
+  dev->gamepad_db = gamepad_db_find(vid, pid);
+  if (dev->gamepad_db) {
+    printf("Gamepad %04X:%04X is in the database\r\n", vid, pid);
+  }
+
   // Interface protocol (hid_interface_protocol_enum_t)
   const char* protocol_str[] = { "None", "Keyboard", "Mouse" };
   uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
@@ -123,22 +223,24 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
   printf("HID Interface Mode     = %s\r\n", protocol_mode ? "Report" : "Boot");
 
   if (protocol_mode == HID_PROTOCOL_BOOT && itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
-    enable_keyboard();
+    enable_keyboard(dev_addr);
   } else if (protocol_mode == HID_PROTOCOL_BOOT && itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
-    enable_mouse();
+    enable_mouse(dev_addr);
   } else {
-    hid_info[instance].report_count = hid_parse_report_descriptor(hid_info[instance].report_info, MAX_REPORT, desc_report, desc_len);
-    printf("HID has %u reports \r\n", hid_info[instance].report_count);
-    gamepad_inited = false;
-    mouse_inited = false;
-    keyboard_inited = false;
+    dev->hid_info[instance].report_count = hid_parse_report_descriptor(dev->hid_info[instance].report_info, MAX_REPORT, desc_report, desc_len);
+    printf("HID has %u reports \r\n", dev->hid_info[instance].report_count);
+    memset(dev->hid_info[instance].report_cache, 0, sizeof(dev->hid_info[instance].report_cache));
+    dev->gamepad_inited = false;
+    memset(&dev->gamepad_old_info, 0, sizeof(dev->gamepad_old_info));
+    dev->mouse_inited = false;
+    dev->keyboard_inited = false;
 
     if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
 	printf("Enable keyboard\n");
-	enable_keyboard();
+	enable_keyboard(dev_addr);
     } else if (itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
 	printf("Enable mouse\n");
-	enable_mouse();
+	enable_mouse(dev_addr);
     }
   }
 
@@ -154,21 +256,27 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
 void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance)
 {
   printf("HID device address = %d, instance = %d is unmounted\r\n", dev_addr, instance);
+
+  disable_input(dev_addr);
 }
 
 // Invoked when received report from device via interrupt endpoint
 void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
 {
+  if (dev_addr > CFG_TUH_DEVICE_MAX || instance >= CFG_TUH_HID) {
+    return;
+  }
+
   uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
 
   uint8_t const protocol_mode = tuh_hid_get_protocol(dev_addr, instance);
 
   if (protocol_mode == HID_PROTOCOL_BOOT && itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
       TU_LOG2("HID receive boot keyboard report\r\n");
-      process_kbd_boot_report( (hid_keyboard_report_t const*) report );
+      process_kbd_boot_report(dev_addr, (hid_keyboard_report_t const*) report );
   } else if (protocol_mode == HID_PROTOCOL_BOOT && itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
       TU_LOG2("HID receive boot mouse report\r\n");
-      process_mouse_boot_report( (hid_mouse_report_t const*) report );
+      process_mouse_boot_report(dev_addr, (hid_mouse_report_t const*) report );
   } else {
       // Generic report requires matching ReportID and contents with previous parsed report info
       process_generic_report(dev_addr, instance, report, len);
@@ -185,7 +293,7 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
 // Keyboard
 //--------------------------------------------------------------------+
 
-static void process_kbd_boot_report(hid_keyboard_report_t const *report)
+static void process_kbd_boot_report(uint8_t dev_addr, hid_keyboard_report_t const *report)
 {
     uint16_t keys[3] = { 0 };
     uint8_t pressed = 0;
@@ -210,63 +318,77 @@ static void process_kbd_boot_report(hid_keyboard_report_t const *report)
 	}
     }
 
-    update_keys(keys, (pressed > 3) ? true : false, home);
+    update_keys(dev_addr, keys, (pressed > 3) ? true : false, home);
 }
 
 //--------------------------------------------------------------------+
 // Mouse
 //--------------------------------------------------------------------+
 
-static void process_mouse_boot_report(hid_mouse_report_t const * report)
+static void process_mouse_boot_report(uint8_t dev_addr, hid_mouse_report_t const * report)
 {
   TU_LOG2_MEM((uint8_t *)report, sizeof(hid_mouse_report_t), 2);
 
-  update_mouse(report->buttons, report->x, report->y, report->wheel, 0);
+  update_mouse(dev_addr, report->buttons, report->x, report->y, report->wheel, 0);
 }
 
 //--------------------------------------------------------------------+
 // Generic Report
 //--------------------------------------------------------------------+
 
-static int32_t to_signed_value(const hid_report_item_t *item, const uint8_t *report, uint16_t len)
+static void compile_axis(gamepad_plan_t *plan, const hid_report_item_t *item, uint8_t flags, uint16_t dest)
 {
-    int32_t value = 0;
+    axis_scale_t *axis = &plan->axis[dest];
+
+    axis->center = 0;
+    axis->shift = 0;
+    axis->flags = flags;
 
-    if (hid_parse_get_item_value(item, report, len, &value)) {
-	int32_t midval = ((item->attributes.logical.max - item->attributes.logical.min) >> 1) + 1;
-	value -= midval;
-	value <<= (16 - item->bit_size);
+    if (item) {
+        axis->center = ((item->attributes.logical.max - item->attributes.logical.min) >> 1) + 1;
+        axis->shift = (item->bit_size < 16) ? 16 - item->bit_size : 0;
     }
 
+    hid_parse_compile_op(&plan->plan, item, false, dest);
+}
+
+// Axis with the flags of the gamepad database, full range -32767..32767
+static int32_t axis_value(int32_t value, const axis_scale_t *axis)
+{
+    value = (value - axis->center) << axis->shift;
+
     if (value >  32767) value =  32767;
     if (value < -32767) value = -32767;
 
+    if (axis->flags & GAMEPAD_AXIS_INVERT) {
+        value = -value;
+    }
+
+    if (axis->flags & GAMEPAD_AXIS_HALF) {
+        value = (value > 0) ? value * 2 - 32767 : -32767;
+    }
+
     return value;
 }
 
-static bool to_bit_value(const hid_report_item_t *item, const uint8_t *report, uint16_t len)
+// A d-pad direction on an axis is pressed past half of its travel
+static bool axis_pressed(int32_t value, const axis_scale_t *axis)
 {
-    int32_t value = 0;
-
-    hid_parse_get_item_value(item, report, len, &value);
+    value = axis_value(value, axis);
 
-    return value ? true : false;
+    return value > ((axis->flags & GAMEPAD_AXIS_HALF) ? 0 : 16383);
 }
 
-static int8_t to_signed_value8(const hid_report_item_t *item, const uint8_t *report, uint16_t len)
+static int8_t clamp8(int32_t value)
 {
-    int32_t value = 0;
-
-    if (hid_parse_get_item_value(item, report, len, &value)) {
-        value = (value > 127) ? 127 : (value < -127) ? -127 : value;
-    }
-
-    return value;
+    return (value > 127) ? 127 : (value < -127) ? -127 : value;
 }
 
-static void mouse_setup(hid_report_info_t *info)
+static void mouse_setup(extract_plan_t *plan, hid_report_info_t *info)
 {
-    mouse_items_t *items = &mouse_items;
+    mouse_items_t items_buf;
+    mouse_items_t *items = &items_buf;
+
     memset(items, 0, sizeof(mouse_items_t));
 
     if (!hid_parse_find_item_by_usage(info, RI_MAIN_INPUT, HID_USAGE_DESKTOP_X, &items->x)) {
@@ -304,41 +426,231 @@ static void mouse_setup(hid_report_info_t *info)
     if (!hid_parse_find_bit_item_by_page(info, RI_MAIN_INPUT, HID_USAGE_PAGE_BUTTON, 4, &items->fw)) {
         printf("No FW\n");
     }
+
+    plan->count = 0;
+    hid_parse_compile_op(plan, items->lb, true, 0x01);
+    hid_parse_compile_op(plan, items->rb, true, 0x02);
+    hid_parse_compile_op(plan, items->mb, true, 0x04);
+    hid_parse_compile_op(plan, items->bw, true, 0x08);
+    hid_parse_compile_op(plan, items->fw, true, 0x10);
+    hid_parse_compile_op(plan, items->x, false, MOUSE_VALUE_X);
+    hid_parse_compile_op(plan, items->y, false, MOUSE_VALUE_Y);
+    hid_parse_compile_op(plan, items->wheel, false, MOUSE_VALUE_WHEEL);
+    hid_parse_compile_op(plan, items->acpan, false, MOUSE_VALUE_ACPAN);
 }
 
-static void process_mouse_report(hid_report_info_t *rpt_info, uint8_t const* report, uint16_t len)
+static void process_mouse_report(uint8_t dev_addr, hid_report_info_t *rpt_info, uint8_t const* report, uint16_t len)
 {
-    mouse_items_t *items = &mouse_items;
-    int32_t value;
-    uint8_t butts = 0;
-    int8_t x, y, wheel, acpan;
+    hid_device_t *dev = get_device(dev_addr);
+    int32_t values[MOUSE_VALUES] = { 0 };
+    uint8_t butts;
 
-    if (!mouse_inited) {
-        mouse_setup(rpt_info);
-        mouse_inited = true;
+    if (!dev->mouse_inited) {
+        mouse_setup(&dev->mouse_plan, rpt_info);
+        dev->mouse_inited = true;
     }
 
 //    debug_dump_16(report);
 
-    if (to_bit_value(items->lb, report, len)) butts |= 0x01;
-    if (to_bit_value(items->rb, report, len)) butts |= 0x02;
-    if (to_bit_value(items->mb, report, len)) butts |= 0x04;
-    if (to_bit_value(items->bw, report, len)) butts |= 0x08;
-    if (to_bit_value(items->fw, report, len)) butts |= 0x10;
+    butts = hid_parse_extract(&dev->mouse_plan, report, len, values);
+
+    // high DPI mice move more than 127 counts per report
+    update_mouse(dev_addr, butts, values[MOUSE_VALUE_X], values[MOUSE_VALUE_Y],
+                 clamp8(values[MOUSE_VALUE_WHEEL]), clamp8(values[MOUSE_VALUE_ACPAN]));
+}
+
+// The n-th axis of the report, in the order of SDL on Windows
+static bool find_axis(hid_report_info_t *info, uint8_t n, const hid_report_item_t **item)
+{
+    for (uint16_t usage = HID_USAGE_DESKTOP_X; usage <= HID_USAGE_DESKTOP_WHEEL; usage++) {
+        if (hid_parse_find_item_by_usage(info, RI_MAIN_INPUT, usage, item) && n-- == 0) {
+            return true;
+        }
+    }
+
+    *item = NULL;
+
+    return false;
+}
+
+// The n-th hat switch of the report
+static const hid_report_item_t *find_hat(hid_report_info_t *info, uint8_t n)
+{
+    for (int i = 0; i < info->num_items; i++) {
+        const hid_report_item_t *item = &info->item[i];
 
-    x = to_signed_value8(items->x, report, len);
-    y = to_signed_value8(items->y, report, len);
-    wheel = to_signed_value8(items->wheel, report, len);
-    acpan = to_signed_value8(items->acpan, report, len);
+        if (item->item_type == RI_MAIN_INPUT &&
+            item->attributes.usage.usage == HID_USAGE_DESKTOP_HAT_SWITCH && n-- == 0) {
+            return item;
+        }
+    }
 
-    update_mouse(butts, x, y, wheel, acpan);
+    return NULL;
 }
 
-static void gamepad_setup(hid_report_info_t *info)
+static const hid_report_item_t *find_control(hid_report_info_t *info, uint8_t control, uint8_t *flags)
 {
-    gamepad_items_t *items = &gamepad_items;
+    const hid_report_item_t *item = NULL;
+
+    if (control < GAMEPAD_AXIS) {
+        hid_parse_find_bit_item_by_page(info, RI_MAIN_INPUT, HID_USAGE_PAGE_BUTTON, control, &item);
+    } else if (control < GAMEPAD_HAT) {
+        find_axis(info, control & 0x0F, &item);
+        if (flags) {
+            *flags = control & 0x70;
+        }
+    } else if (control != GAMEPAD_NONE) {
+        item = find_hat(info, (control >> 4) & 0x03);
+    }
+
+    return item;
+}
+
+static void gamepad_setup_db(gamepad_items_t *items, hid_report_info_t *info, const struct gamepad_db_entry *db)
+{
+    const uint8_t *c = db->control;
+
+    items->lx = find_control(info, c[GAMEPAD_LX], &items->lx_flags);
+    items->ly = find_control(info, c[GAMEPAD_LY], &items->ly_flags);
+    items->rx = find_control(info, c[GAMEPAD_RX], &items->rx_flags);
+    items->ry = find_control(info, c[GAMEPAD_RY], &items->ry_flags);
+    items->lt = find_control(info, c[GAMEPAD_LT], &items->lt_flags);
+    items->rt = find_control(info, c[GAMEPAD_RT], &items->rt_flags);
+    items->a = find_control(info, c[GAMEPAD_A], NULL);
+    items->b = find_control(info, c[GAMEPAD_B], NULL);
+    items->x = find_control(info, c[GAMEPAD_X], NULL);
+    items->y = find_control(info, c[GAMEPAD_Y], NULL);
+    items->lb = find_control(info, c[GAMEPAD_LB], NULL);
+    items->rb = find_control(info, c[GAMEPAD_RB], NULL);
+    items->start = find_control(info, c[GAMEPAD_START], NULL);
+    // select is the xbox button of the adapter, the guide button if there is no back
+    items->select = find_control(info, c[GAMEPAD_BACK] != GAMEPAD_NONE ? c[GAMEPAD_BACK] : c[GAMEPAD_GUIDE], NULL);
+    items->sl = find_control(info, c[GAMEPAD_L3], NULL);
+    items->sr = find_control(info, c[GAMEPAD_R3], NULL);
+
+    // each d-pad direction is a button, an axis or a position of one hat switch
+    for (int i = 0; i < 4; i++) {
+        uint8_t control = c[GAMEPAD_DPAD_UP + i];
+
+        if (control == GAMEPAD_NONE) {
+            continue;
+        }
+
+        if (control >= GAMEPAD_HAT) {
+            if (!items->hat) {
+                items->hat = find_control(info, control, NULL);
+            }
+            items->hat_mask[i] = control & 0x0F;
+        } else {
+            items->dpad[i] = find_control(info, control, &items->dpad_flags[i]);
+            if (items->dpad[i] && control >= GAMEPAD_AXIS) {
+                items->dpad_flags[i] |= GAMEPAD_AXIS;
+            }
+        }
+    }
+
+    // no d-pad found where the entry says, take the first hat switch as
+    // for gamepads without an entry
+    if (!items->hat && !items->dpad[0] && !items->dpad[1] && !items->dpad[2] && !items->dpad[3]) {
+        items->hat = find_hat(info, 0);
+        memcpy(items->hat_mask, dpad_hat_mask, sizeof(items->hat_mask));
+    }
+
+    // a trigger on an axis is analog
+    if (items->lt && c[GAMEPAD_LT] >= GAMEPAD_AXIS && c[GAMEPAD_LT] < GAMEPAD_HAT) {
+        items->lt_flags |= GAMEPAD_AXIS;
+    }
+    if (items->rt && c[GAMEPAD_RT] >= GAMEPAD_AXIS && c[GAMEPAD_RT] < GAMEPAD_HAT) {
+        items->rt_flags |= GAMEPAD_AXIS;
+    }
+}
+
+static void gamepad_compile(gamepad_plan_t *plan, const gamepad_items_t *items)
+{
+    plan->plan.count = 0;
+
+    hid_parse_compile_op(&plan->plan, items->a, true, XPAD_PAD_A);
+    hid_parse_compile_op(&plan->plan, items->b, true, XPAD_PAD_B);
+    hid_parse_compile_op(&plan->plan, items->x, true, XPAD_PAD_X);
+    hid_parse_compile_op(&plan->plan, items->y, true, XPAD_PAD_Y);
+    hid_parse_compile_op(&plan->plan, items->lb, true, XPAD_PAD_LB);
+    hid_parse_compile_op(&plan->plan, items->rb, true, XPAD_PAD_RB);
+    hid_parse_compile_op(&plan->plan, items->start, true, XPAD_START);
+    hid_parse_compile_op(&plan->plan, items->select, true, XPAD_XLOGO);
+    hid_parse_compile_op(&plan->plan, items->sl, true, XPAD_STICK_L);
+    hid_parse_compile_op(&plan->plan, items->sr, true, XPAD_STICK_R);
+
+    for (int i = 0; i < 4; i++) {
+        if (items->dpad_flags[i] & GAMEPAD_AXIS) {
+            compile_axis(plan, items->dpad[i], items->dpad_flags[i], GAMEPAD_VALUE_DPAD_UP + i);
+        } else {
+            hid_parse_compile_op(&plan->plan, items->dpad[i], true, dpad_buttons[i]);
+            plan->axis[GAMEPAD_VALUE_DPAD_UP + i].flags = 0;
+        }
+    }
+
+    compile_axis(plan, items->lx, items->lx_flags, GAMEPAD_VALUE_LX);
+    compile_axis(plan, items->ly, items->ly_flags, GAMEPAD_VALUE_LY);
+    compile_axis(plan, items->rx, items->rx_flags, GAMEPAD_VALUE_RX);
+    compile_axis(plan, items->ry, items->ry_flags, GAMEPAD_VALUE_RY);
+    compile_axis(plan, items->lt, items->lt_flags, GAMEPAD_VALUE_LT);
+    compile_axis(plan, items->rt, items->rt_flags, GAMEPAD_VALUE_RT);
+    hid_parse_compile_op(&plan->plan, items->hat, false, GAMEPAD_VALUE_HAT);
+    memcpy(plan->hat_mask, items->hat_mask, sizeof(plan->hat_mask));
+
+    memset(plan->used, 0, sizeof(plan->used));
+    plan->used_len = 0;
+
+    for (int i = 0; i < plan->plan.count; i++) {
+        const extract_op_t *op = &plan->plan.op[i];
+        uint64_t bits = (uint64_t) op->mask << op->shift;
+
+        for (int b = op->offset; b <= op->last && b < sizeof(plan->used); b++, bits >>= 8) {
+            plan->used[b] |= bits & 0xFF;
+        }
+
+        plan->used_len = MAX(plan->used_len, MIN(op->last + 1, sizeof(plan->used)));
+    }
+}
+
+// Compare the bits the plan reads with the last report of this ID and keep
+// them, false if none changed
+static bool report_changed(const gamepad_plan_t *plan, report_cache_t *cache, const uint8_t *report, uint16_t len)
+{
+    uint16_t n = MIN(len, plan->used_len);
+    uint16_t i = 0;
+
+    if (len == cache->len) {
+        while (i < n && (report[i] & plan->used[i]) == cache->data[i]) {
+            i++;
+        }
+
+        if (i == n) {
+            return false;
+        }
+    }
+
+    for (; i < n; i++) {
+        cache->data[i] = report[i] & plan->used[i];
+    }
+    cache->len = len;
+
+    return true;
+}
+
+static void gamepad_setup(gamepad_plan_t *plan, hid_report_info_t *info, const struct gamepad_db_entry *db)
+{
+    gamepad_items_t items_buf;
+    gamepad_items_t *items = &items_buf;
+
     memset(items, 0, sizeof(gamepad_items_t));
 
+    if (db) {
+        gamepad_setup_db(items, info, db);
+        gamepad_compile(plan, items);
+        return;
+    }
+
     if (!hid_parse_find_item_by_usage(info, RI_MAIN_INPUT, HID_USAGE_DESKTOP_X, &items->lx)) {
         printf("No LX\n");
     }
@@ -358,6 +670,7 @@ static void gamepad_setup(hid_report_info_t *info)
     if (!hid_parse_find_item_by_usage(info, RI_MAIN_INPUT, HID_USAGE_DESKTOP_HAT_SWITCH, &items->hat)) {
         printf("No HAT\n");
     }
+    memcpy(items->hat_mask, dpad_hat_mask, sizeof(items->hat_mask));
 
     if (!hid_parse_find_bit_item_by_page(info, RI_MAIN_INPUT, HID_USAGE_PAGE_BUTTON, 0, &items->a)) {
         printf("No A\n");
@@ -406,82 +719,101 @@ static void gamepad_setup(hid_report_info_t *info)
     if (!hid_parse_find_bit_item_by_page(info, RI_MAIN_INPUT, HID_USAGE_PAGE_BUTTON, 11, &items->sr)) {
         printf("No SR\n");
     }
+
+    gamepad_compile(plan, items);
 }
 
-static void process_gamepad_report(hid_report_info_t *rpt_info, uint8_t const* report, uint16_t len)
+static void process_gamepad_report(uint8_t dev_addr, hid_report_info_t *rpt_info, report_cache_t *cache, uint8_t const* report, uint16_t len)
 {
-    static xpad_controller_t old_info;
+    hid_device_t *dev = get_device(dev_addr);
+    xpad_controller_t *old_info = &dev->gamepad_old_info;
     xpad_controller_t info;
-    gamepad_items_t *items = &gamepad_items;
-    int32_t value;
+    gamepad_plan_t *plan = &dev->gamepad_plan;
+    int32_t values[GAMEPAD_VALUES] = { 0 };
 
-    if (!gamepad_inited) {
-        gamepad_setup(rpt_info);
-        gamepad_inited = true;
+    if (!dev->gamepad_inited) {
+        gamepad_setup(plan, rpt_info, dev->gamepad_db);
+        dev->gamepad_inited = true;
 
-        enable_hid_gamepad();
+        enable_hid_gamepad(dev_addr);
+    }
+
+    if (!report_changed(plan, cache, report, len)) {
+        return;
     }
 
 //    debug_dump_16(report);
 
     memset(&info, 0, sizeof(xpad_controller_t));
 
-    if (to_bit_value(items->a, report, len))  info.buttons |= XPAD_PAD_A;
-    if (to_bit_value(items->b, report, len))  info.buttons |= XPAD_PAD_B;
-    if (to_bit_value(items->x, report, len))  info.buttons |= XPAD_PAD_X;
-    if (to_bit_value(items->y, report, len))  info.buttons |= XPAD_PAD_Y;
-    if (to_bit_value(items->lb, report, len)) info.buttons |= XPAD_PAD_LB;
-    if (to_bit_value(items->rb, report, len)) info.buttons |= XPAD_PAD_RB;
-    if (to_bit_value(items->start, report, len)) info.buttons |= XPAD_START;
-    if (to_bit_value(items->select, report, len)) info.buttons |= XPAD_XLOGO;
-    if (to_bit_value(items->sl, report, len)) info.buttons |= XPAD_STICK_L;
-    if (to_bit_value(items->sr, report, len)) info.buttons |= XPAD_STICK_R;
-
-    if (to_bit_value(items->lt, report, len)) info.lt = 1027; else info.lt = 0;
-    if (to_bit_value(items->rt, report, len)) info.rt = 1027; else info.rt = 0;
-
-    if (hid_parse_get_item_value(items->hat, report, len, &value)) {
-//        printf("HAT = %d\n", value);
-        switch(value) {
-        case 0: info.buttons |= XPAD_HAT_UP; break;
-        case 1: info.buttons |= XPAD_HAT_UP | XPAD_HAT_RIGHT; break;
-        case 2: info.buttons |= XPAD_HAT_RIGHT; break;
-        case 3: info.buttons |= XPAD_HAT_RIGHT | XPAD_HAT_DOWN; break;
-        case 4: info.buttons |= XPAD_HAT_DOWN; break;
-        case 5: info.buttons |= XPAD_HAT_DOWN | XPAD_HAT_LEFT; break;
-        case 6: info.buttons |= XPAD_HAT_LEFT; break;
-        case 7: info.buttons |= XPAD_HAT_LEFT | XPAD_HAT_UP; break;
+    // axes a short report leaves out are centered, triggers that are buttons
+    // released, no hat unless the report has one
+    for (int i = 0; i < GAMEPAD_VALUE_HAT; i++) {
+        if (i < GAMEPAD_VALUE_LT || (plan->axis[i].flags & GAMEPAD_AXIS)) {
+            values[i] = plan->axis[i].center;
         }
     }
+    values[GAMEPAD_VALUE_HAT] = -1;
+
+    info.buttons = hid_parse_extract(&plan->plan, report, len, values);
+
+    // analog triggers go 0..1023 like on xbox gamepads
+    if (plan->axis[GAMEPAD_VALUE_LT].flags & GAMEPAD_AXIS) {
+        info.lt = (axis_value(values[GAMEPAD_VALUE_LT], &plan->axis[GAMEPAD_VALUE_LT]) + 32767) >> 6;
+    } else if (values[GAMEPAD_VALUE_LT]) info.lt = 1027; else info.lt = 0;
+    if (plan->axis[GAMEPAD_VALUE_RT].flags & GAMEPAD_AXIS) {
+        info.rt = (axis_value(values[GAMEPAD_VALUE_RT], &plan->axis[GAMEPAD_VALUE_RT]) + 32767) >> 6;
+    } else if (values[GAMEPAD_VALUE_RT]) info.rt = 1027; else info.rt = 0;
 
-    info.lx =  to_signed_value(items->lx, report, len);
-    info.ly = -to_signed_value(items->ly, report, len);
-    info.rx =  to_signed_value(items->rx, report, len);
-    info.ry = -to_signed_value(items->ry, report, len);
+//    printf("HAT = %d\n", values[GAMEPAD_VALUE_HAT]);
+    if (values[GAMEPAD_VALUE_HAT] >= 0 && values[GAMEPAD_VALUE_HAT] < 8) {
+        uint8_t directions = hat_directions[values[GAMEPAD_VALUE_HAT]];
 
-    if (memcmp(&info, &old_info, sizeof(xpad_controller_t))) {
-        tuh_xpad_read_cb(-1, (uint8_t *) report, &info);
-        memcpy(&old_info, &info, sizeof(xpad_controller_t));
+        for (int i = 0; i < 4; i++) {
+            if (directions & plan->hat_mask[i]) {
+                info.buttons |= dpad_buttons[i];
+            }
+        }
+    }
+
+    for (int i = 0; i < 4; i++) {
+        const axis_scale_t *axis = &plan->axis[GAMEPAD_VALUE_DPAD_UP + i];
+
+        if ((axis->flags & GAMEPAD_AXIS) && axis_pressed(values[GAMEPAD_VALUE_DPAD_UP + i], axis)) {
+            info.buttons |= dpad_buttons[i];
+        }
+    }
+
+    info.lx =  axis_value(values[GAMEPAD_VALUE_LX], &plan->axis[GAMEPAD_VALUE_LX]);
+    info.ly = -axis_value(values[GAMEPAD_VALUE_LY], &plan->axis[GAMEPAD_VALUE_LY]);
+    info.rx =  axis_value(values[GAMEPAD_VALUE_RX], &plan->axis[GAMEPAD_VALUE_RX]);
+    info.ry = -axis_value(values[GAMEPAD_VALUE_RY], &plan->axis[GAMEPAD_VALUE_RY]);
+
+    if (memcmp(&info, old_info, sizeof(xpad_controller_t))) {
+        tuh_xpad_read_cb(dev_addr, (uint8_t *) report, &info);
+        memcpy(old_info, &info, sizeof(xpad_controller_t));
     }
 }
 
-static void process_keyboard_report(hid_report_info_t *rpt_info, uint8_t const* report, uint16_t len)
+static void process_keyboard_report(uint8_t dev_addr, hid_report_info_t *rpt_info, uint8_t const* report, uint16_t len)
 {
-    if (!keyboard_inited) {
-        keyboard_inited = true;
+    hid_device_t *dev = get_device(dev_addr);
+
+    if (!dev->keyboard_inited) {
+        dev->keyboard_inited = true;
     }
 
     if (len == 8) {
-	process_kbd_boot_report( (hid_keyboard_report_t const*) report );
+	process_kbd_boot_report(dev_addr, (hid_keyboard_report_t const*) report );
     }
 }
 
 static void process_generic_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
 {
-  (void) dev_addr;
+  hid_info_t *hid_info = &get_device(dev_addr)->hid_info[instance];
 
-  uint8_t const rpt_count = hid_info[instance].report_count;
-  hid_report_info_t* rpt_info_arr = hid_info[instance].report_info;
+  uint8_t const rpt_count = hid_info->report_count;
+  hid_report_info_t* rpt_info_arr = hid_info->report_info;
   hid_report_info_t* rpt_info = NULL;
 
   if ( rpt_count == 1 && rpt_info_arr[0].report_id == 0)
@@ -530,25 +862,25 @@ static void process_generic_report(uint8_t dev_addr, uint8_t instance, uint8_t c
       case HID_USAGE_DESKTOP_KEYBOARD:
         TU_LOG1("HID receive keyboard report\r\n");
         // Assume keyboard follow boot report layout
-        process_keyboard_report(rpt_info, report, len);
+        process_keyboard_report(dev_addr, rpt_info, report, len);
       break;
 
       case HID_USAGE_DESKTOP_MOUSE:
         TU_LOG1("HID receive mouse report\r\n");
         // Assume mouse follow boot report layout
-        process_mouse_report(rpt_info, report, len);
+        process_mouse_report(dev_addr, rpt_info, report, len);
       break;
 
       case HID_USAGE_DESKTOP_JOYSTICK:
         TU_LOG1("HID receive joystick report\r\n");
         TU_LOG2_MEM((uint8_t *)report, 8, 2);
-        process_gamepad_report(rpt_info, report, len);
+        process_gamepad_report(dev_addr, rpt_info, &hid_info->report_cache[rpt_info - rpt_info_arr], report, len);
       break;
 
       case HID_USAGE_DESKTOP_GAMEPAD:
         TU_LOG1("HID receive gamepad report\r\n");
         TU_LOG2_MEM((uint8_t *)report, 8, 2);
-        process_gamepad_report(rpt_info, report, len);
+        process_gamepad_report(dev_addr, rpt_info, &hid_info->report_cache[rpt_info - rpt_info_arr], report, len);
       break;
 
       default: break;
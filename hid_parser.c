@@ -2,8 +2,11 @@
 // build parser test
 // gcc hid_parser.c -o hid_parser -DPARSER_TEST -Ipico-sdk/lib/tinyusb/src/ -I. -Wall
 //
+// build extraction test
+// gcc hid_parser.c -o hid_extract -DEXTRACT_TEST -Ipico-sdk/lib/tinyusb/src/ -I. -O2 -Wall
+//
 
-#ifndef PARSER_TEST
+#if !defined(PARSER_TEST) && !defined(EXTRACT_TEST)
 #include "bsp/board.h"
 #else
 #define CFG_TUSB_MCU OPT_MCU_LPC54XXX
@@ -318,6 +321,89 @@ bool hid_parse_get_item_value(const hid_report_item_t *item, const uint8_t *repo
     return true;
 }
 
+//--------------------------------------------------------------------+
+// Report Field Extraction
+//--------------------------------------------------------------------+
+
+void hid_parse_compile_op(extract_plan_t *plan, const hid_report_item_t *item, bool button, uint16_t dest)
+{
+    extract_op_t *op;
+
+    if (!item || item->bit_size == 0 || item->bit_size > 32 || plan->count >= MAX_EXTRACT_OPS) {
+        return;
+    }
+
+    op = &plan->op[plan->count++];
+    op->offset = item->bit_offset >> 3;
+    op->shift = item->bit_offset & 0x07;
+    op->last = (item->bit_offset + item->bit_size - 1) >> 3;
+    op->mask = 0xFFFFFFFF >> (32 - item->bit_size);
+    op->sign = item->attributes.logical.min < 0;
+    op->dest = dest;
+
+    if (button) {
+        op->kind = (item->bit_size == 1) ? OP_BUTTON : OP_BUTTONS;
+    } else if (op->shift == 0 && item->bit_size == 8) {
+        op->kind = op->sign ? OP_S8 : OP_U8;
+    } else if (op->shift == 0 && item->bit_size == 16) {
+        op->kind = op->sign ? OP_S16 : OP_U16;
+    } else {
+        op->kind = OP_BITS;
+    }
+}
+
+// Run the ops of a plan over a report, returns the buttons
+uint16_t hid_parse_extract(const extract_plan_t *plan, const uint8_t *report, uint16_t len, int32_t *values)
+{
+    uint16_t buttons = 0;
+
+    for (const extract_op_t *op = plan->op; op < plan->op + plan->count; op++) {
+        const uint8_t *p = report + op->offset;
+        uint64_t bits;
+        int32_t value;
+
+        if (op->last >= len) {
+            continue;
+        }
+
+        switch (op->kind) {
+        case OP_BUTTON:
+            if (p[0] & (1 << op->shift)) buttons |= op->dest;
+            break;
+        case OP_U8:
+            values[op->dest] = p[0];
+            break;
+        case OP_S8:
+            values[op->dest] = (int8_t) p[0];
+            break;
+        case OP_U16:
+            values[op->dest] = p[0] | (p[1] << 8);
+            break;
+        case OP_S16:
+            values[op->dest] = (int16_t) (p[0] | (p[1] << 8));
+            break;
+        default:
+            bits = 0;
+            for (int i = op->last - op->offset; i >= 0; i--) {
+                bits = (bits << 8) | p[i];
+            }
+            value = (bits >> op->shift) & op->mask;
+
+            if (op->kind == OP_BUTTONS) {
+                if (value) buttons |= op->dest;
+                break;
+            }
+            if (op->sign && (value & ~(op->mask >> 1))) {
+                value |= ~op->mask;
+            }
+            values[op->dest] = value;
+            break;
+        }
+    }
+
+    return buttons;
+}
+
 #ifdef PARSER_TEST
 
 #if 1
@@ -426,3 +512,69 @@ int main(int argc, char *argv[])
     return 0;
 }
 #endif
+
+#ifdef EXTRACT_TEST
+
+#include <stdlib.h>
+
+#define TEST_ITEMS	200000
+#define TEST_REPORT	64
+
+// Random fields of 1 to 31 bits at any bit offset, signed and unsigned, in
+// reports of random length. At 32 bits the mask shift of
+// hid_parse_get_item_value() is undefined, so it can not be compared.
+int main(int argc, char *argv[])
+{
+    uint8_t report[TEST_REPORT];
+    int failed = 0;
+
+    srand(1);
+
+    for (int n = 0; n < TEST_ITEMS; n++) {
+        hid_report_item_t item = { 0 };
+        extract_plan_t plan = { 0 };
+        bool button = (rand() & 3) == 0;
+        uint16_t len = 1 + rand() % TEST_REPORT;
+        int32_t values[2] = { 0, 0x5A5A5A5A };
+        int32_t expected = 0x5A5A5A5A;
+        int32_t value;
+        uint16_t buttons;
+        bool fits;
+
+        item.bit_size = 1 + rand() % 31;
+        item.bit_offset = rand() % ((TEST_REPORT - 4) * 8);
+        item.attributes.logical.min = (rand() & 1) ? -1 : 0;
+
+        for (int i = 0; i < TEST_REPORT; i++) {
+            report[i] = rand();
+        }
+
+        hid_parse_compile_op(&plan, &item, button, 1);
+        buttons = hid_parse_extract(&plan, report, len, values);
+
+        // a field past the end of the report is skipped
+        fits = plan.op[0].last < len;
+        if (fits) {
+            hid_parse_get_item_value(&item, report, TEST_REPORT, &expected);
+        }
+
+        if (button) {
+            value = buttons != 0;
+            expected = fits && expected != 0;
+        } else {
+            value = values[1];
+        }
+
+        if (value != expected) {
+            printf("item %d: offset %d size %d min %d len %d: %08x, expected %08x\n",
+                   n, item.bit_offset, item.bit_size, item.attributes.logical.min, len,
+                   value, expected);
+            failed++;
+        }
+    }
+
+    printf("%d of %d items differ\n", failed, TEST_ITEMS);
+
+    return failed != 0;
+}
+#endif
@@ -47,6 +47,38 @@ typedef struct {
 //  uint8_t out_len;     // length of OUT report
 } hid_report_info_t;
 
+// A report field to extract, compiled from a report item by
+// hid_parse_compile_op(). Buttons OR their mask into the buttons, values go to
+// an entry of the value array.
+enum {
+    OP_BUTTON,      // one bit
+    OP_BUTTONS,     // any bit of a wider field
+    OP_U8,          // byte aligned 8 or 16 bit values
+    OP_S8,
+    OP_U16,
+    OP_S16,
+    OP_BITS         // anything else, up to 32 bits
+};
+
+typedef struct {
+    uint8_t kind;
+    uint8_t shift;
+    uint16_t offset;
+    // last byte of the field, shorter reports skip it
+    uint16_t last;
+    uint16_t dest;
+    uint32_t mask;
+    bool sign;
+} extract_op_t;
+
+// a gamepad: 10 buttons, the d-pad, 6 axes and the hat
+#define MAX_EXTRACT_OPS 24
+
+typedef struct {
+    extract_op_t op[MAX_EXTRACT_OPS];
+    uint8_t count;
+} extract_plan_t;
+
 uint8_t hid_parse_report_descriptor(hid_report_info_t* report_info_arr, uint8_t arr_count, uint8_t const* desc_report, uint16_t desc_len);
 
 bool hid_parse_find_item_by_page(hid_report_info_t* report_info_arr, uint8_t type, uint16_t page, const hid_report_item_t **item);
@@ -54,4 +86,7 @@ bool hid_parse_find_item_by_usage(hid_report_info_t* report_info_arr, uint8_t ty
 bool hid_parse_find_bit_item_by_page(hid_report_info_t* report_info_arr, uint8_t type, uint16_t page, uint8_t bit, const hid_report_item_t **item);
 bool hid_parse_get_item_value(const hid_report_item_t *item, const uint8_t *report, uint8_t len, int32_t *value);
 
+void hid_parse_compile_op(extract_plan_t *plan, const hid_report_item_t *item, bool button, uint16_t dest);
+uint16_t hid_parse_extract(const extract_plan_t *plan, const uint8_t *report, uint16_t len, int32_t *values);
+
 #endif
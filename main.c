@@ -26,32 +26,99 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
 #include "hardware/clocks.h"
 #include "hardware/watchdog.h"
-#include "hardware/structs/iobank0.h"
 #include "hardware/irq.h"
-#include "hardware/structs/systick.h"
 #include "hardware/pio.h"
 #include "hardware/flash.h"
 #include "hardware/dma.h"
+#include "hardware/structs/nvic.h"
+#include "pico/flash.h"
 
 #include "bsp/board.h"
 #include "tusb.h"
 
 #include "n64send.pio.h"
+#include "n64recv.pio.h"
 
-#define USE_GPIO_IRQ
+#include "n64_crc.h"
+#include "pak_store.h"
+#include "button_map.h"
+#include "gamepad_db.h"
 
+#define USE_JOYBUS_IRQ
+
+// one controller socket per pin, GP14 and up. N64_PORTS is the number of
+// sockets wired to the board, set by CMake.
 #define N64_DIO_PIN	14
+#ifndef N64_PORTS
+#define N64_PORTS	1
+#endif
+#define JOYBUS_PORTS	N64_PORTS
+
+#if JOYBUS_PORTS < 1 || JOYBUS_PORTS > PAK_STORE_PORTS
+#error "N64_PORTS has to be 1 to 4"
+#endif
 
+// USB devices merged into one controller
+#define PORT_INPUTS	4
+
+// any clock works, the joybus timing follows it
+#define SYS_CLOCK_KHZ	200000
+
+// the PIO programs count in cycles of 83.125 ns, 48 per 4 us bit cell
+#define JOYBUS_PIO_CYCLE_PS	83125
+
+// fixed pak image of older firmware, imported into slot 0 of the pak store
 #define FLASH_TARGET_SIZE	(32 * 1024)
 #define FLASH_TARGET_OFFSET	(2 * 1024 * 1024 - 32 * 1024)
 
+// let a burst of pak writes settle before saving
+#define PAK_FLUSH_DELAY_US	500000
+// no page programs until the console has left the pak alone this long
+#define PAK_IDLE_US		200000
+// no sector erases until the console has sent nothing at all this long
+#define CONSOLE_IDLE_US		500000
+// no poll for this long means the console is idle or off
+#define POLL_IDLE_US		100000
+
+// reboot when a core hangs this long, a sector erase locks core1 out for up to 400 ms
+#define WATCHDOG_TIMEOUT_MS	2000
+// core1 checks in this often, core0 feeds the watchdog when it did
+#define WATCHDOG_CHECKIN_MS	100
+
 #define N64SEND_DATA(d0, d1, b) ((((b) - 1) << 16) | ((d0) << 8) | (d1))
 
+// Gamepad sticks are mapped onto the octagonal gate of an N64 stick: its
+// reach on the axes and on each axis of a diagonal. The original code
+// clamped the axes to 0x50, a new N64 stick reaches about 85 and 69.
+#define STICK_GATE		80
+#define STICK_GATE_DIAG		65
+// in % of the gate: no movement below the deadzone, the gate is reached at
+// the saturation (a round gamepad gate reaches 87% on the diagonals), and
+// the first step past the deadzone jumps to the anti-deadzone
+#define STICK_DEADZONE		12
+#define STICK_SATURATION	87
+#define STICK_ANTI_DEADZONE	0
+// response exponent, above 1 gives finer control near the center
+#define STICK_CURVE		1.0f
+
+// gate distances of an 8-bit stick, grouped by 32
+#define STICK_LUT_SHIFT		5
+#define STICK_LUT_SIZE		((STICK_GATE * 128 >> STICK_LUT_SHIFT) + 1)
+
+// stick steps per mouse count in 1/256, 256 moves 1:1, lower it for high DPI mice
+#define MOUSE_SCALE		256
+// motion carried to the next polls, in polls of full stick steps
+#define MOUSE_BACKLOG_POLLS	4
+
+// controller state in wire order: buttons, buttons, stick x, stick y
+#define N64_STATE(b0, b1, x, y) (((uint32_t)(b0) << 24) | ((uint32_t)(b1) << 16) | ((uint32_t)(uint8_t)(x) << 8) | (uint8_t)(y))
+
 enum {
     USB_UNKNOWN = 0,
     USB_XPAD,
@@ -62,41 +129,154 @@ enum {
 
 const uint8_t *flash_target_contents = (const uint8_t *) (XIP_BASE + FLASH_TARGET_OFFSET);
 
-static uint8_t _dev_addr;
+// The pak blocks held in RAM: blocks read all the time (pages 0-4: id
+// block, index table and its backup) and blocks written but not saved yet
+// (overlay). The rest is read from the store in flash. The overlay is shared
+// by the ports and holds 4 KB. A write that finds it full is refused and
+// the blocks are saved right away, the console retries the write. Entries
+// not needed for writes keep saved blocks the console reads, or is about to
+// read while the flash is busy.
+#define PAK_PINNED_BLOCKS	(5 * 256 / 32)
+#define PAK_OVERLAY_BLOCKS	128
+#define PAK_NO_OVERLAY		0xFF
+
+struct memory_pak {
+    // one bit per 32 byte block that needs saving
+    volatile uint32_t dirty[PAK_STORE_BLOCKS / 32];
+    uint8_t pinned[PAK_PINNED_BLOCKS][32];
+    uint8_t overlay_map[PAK_STORE_BLOCKS];
+    // data CRC of every block
+    uint8_t crc[PAK_STORE_BLOCKS];
+};
 
-static volatile uint8_t input_device = USB_UNKNOWN;
+struct pak_overlay {
+    uint8_t block[PAK_OVERLAY_BLOCKS][32];
+    uint32_t free[PAK_OVERLAY_BLOCKS / 32];
+    // entries holding a saved copy, taken over when no entry is free
+    uint32_t clean[PAK_OVERLAY_BLOCKS / 32];
+    // port << 10 | block of the entries in use
+    uint16_t owner[PAK_OVERLAY_BLOCKS];
+};
 
-static uint16_t m_vid = 0;
-static uint16_t m_pid = 0;
+// Not cleared at boot, so after a watchdog reboot the unsaved writes are
+// still there. pak_resume says whether they can be trusted.
+static struct memory_pak __uninitialized_ram(memory_paks)[JOYBUS_PORTS];
+static struct pak_overlay __uninitialized_ram(pak_overlay);
 
-static volatile uint8_t enable_vibro = 0;
-static volatile uint8_t disable_vibro = 0;
+#define PAK_RESUME_MAGIC	0x4E363452
 
-static volatile uint8_t buttons[2] = { 0, 0 };
-static volatile uint8_t sticks[2] = { 0, 0 };
+struct pak_resume {
+    uint32_t magic;
+    uint8_t slot[JOYBUS_PORTS];
+    uint8_t use_rumble_pack[JOYBUS_PORTS];
+    uint8_t crc;
+};
 
-static volatile uint16_t randnet_keys[3];
-static volatile uint8_t  randnet_pressed;
-static volatile bool     randnet_error;
-static volatile bool     randnet_home;
-static volatile uint8_t  randnet_led_status;
+static struct pak_resume __uninitialized_ram(pak_resume);
+
+struct joybus_port {
+    uint8_t num;
+    uint pin;
+
+    // n64send on sm, n64recv on sm + 1
+    PIO pio;
+    uint sm;
+    uint rx_sm;
+    uint tx_dma_chan;
+    uint rx_dma_chan;
+
+    // 1 byte command + 2 bytes address + 32 bytes data, rounded up to the DMA ring size
+    uint8_t rx_buffer[64] __attribute__((aligned (64)));
+    // 16 words (data) + 1 word (crc) + 1 word (stop)
+    volatile uint32_t dma_buffer[18];
+    uint8_t data_block[32];
+    // set when the command handler started a reply
+    bool response_sent;
+
+    volatile uint8_t input_device;
+    // USB devices driving the port (0: none) and the last state each one
+    // reported, merged into the poll reply by core1
+    uint8_t input_addr[PORT_INPUTS];
+    uint32_t input_state[PORT_INPUTS];
+
+    // Pre-encoded 0x01 replies (buttons, sticks, stop). Core1 fills the buffer
+    // the IRQ is not using and then publishes generation << 1 | buffer index
+    // with one store, so the IRQ gets a consistent reply from a single load.
+    volatile uint32_t poll_response[2][3];
+    volatile uint32_t poll_response_seq;
+
+    // Mouse motion summed by core1 (scaled by MOUSE_SCALE, wrapping) and the
+    // part core0 has sent. A poll sends the difference, at most one full
+    // stick step per axis, and leaves the rest for the next polls.
+    volatile uint32_t mouse_x;
+    volatile uint32_t mouse_y;
+    uint32_t mouse_sent_x;
+    uint32_t mouse_sent_y;
+
+    volatile uint16_t randnet_keys[3];
+    volatile uint8_t  randnet_pressed;
+    volatile bool     randnet_error;
+    volatile bool     randnet_home;
+    volatile uint8_t  randnet_led_status;
+
+    volatile uint8_t use_rumble_pack;
+    volatile uint8_t enable_vibro;
+    volatile uint8_t disable_vibro;
+
+    struct memory_pak *pak;
+    // dirty blocks handed to the store, saved once it has programmed them.
+    // A write clears the bit. Zero at boot, a resume hands them over again.
+    volatile uint32_t pak_staged[PAK_STORE_BLOCKS / 32];
+    volatile uint32_t memory_pak_write_us;
+    // last pak read or write served to the console, and the last frame of any kind
+    volatile uint32_t memory_pak_access_us;
+    // block of the last pak read
+    volatile uint16_t memory_pak_read_block;
+    volatile uint32_t frame_us;
+
+    // store slot being served, and the one picked on the controller
+    volatile uint8_t pak_slot;
+    volatile uint8_t pak_slot_request;
+    // no memory pak while another slot is loaded
+    volatile bool memory_pak_offline;
+
+    // start of the last 0x01 poll and the measured time between two polls
+    volatile uint32_t poll_time_us;
+    volatile uint32_t poll_interval_us;
+
+    // accessory reads/writes rejected for a bad address CRC
+    volatile uint32_t pak_read_addr_errors;
+    volatile uint32_t pak_write_addr_errors;
+    volatile uint32_t unknown_commands;
+};
 
-static volatile uint8_t use_rumble_pack = 0;
-static volatile uint8_t memory_pak_changed = 0;
+static struct joybus_port ports[JOYBUS_PORTS];
+
+// State of a USB input device, indexed by dev_addr - 1. A device takes the
+// first free port when it is mounted, reports go straight to that port.
+struct usb_input {
+    struct joybus_port *port;
+    // index in port->input_addr
+    uint8_t source;
+    uint8_t input_device;
+    uint16_t vid;
+    uint16_t pid;
+    uint16_t old_buttons;
+    bool slot_changed;
+};
 
-static volatile bool core1_disable_irq = false;
+static struct usb_input usb_inputs[CFG_TUH_DEVICE_MAX];
 
-static uint8_t data_block[32];
-static uint8_t memory_pak[32768];
+// set while the flash is erased or programmed, XIP reads stall until it is done
+static volatile bool flash_busy = false;
 
-static volatile PIO pio;
-static volatile uint sm;
-static volatile uint pio_offset;
+// a pak write was refused for a full overlay, save without waiting
+static volatile bool pak_overlay_full = false;
 
-static volatile uint32_t pio_dma_chan;
+static uint8_t rumble_block_crc;
 
-// 16 words (data) + 1 word (crc) + 1 word (stop)
-static volatile uint32_t dma_buffer[18] __attribute__((aligned (16)));
+// the receive DMA never stops on its own, it wraps inside rx_buffer
+#define RX_DMA_COUNT	0xFFFFFFFF
 
 //--------------------------------------------------------------------+
 // MACRO CONSTANT TYPEDEF PROTYPES
@@ -106,130 +286,404 @@ extern void hid_app_task(void);
 
 void debug_dump_16(uint8_t *ptr);
 
+static void publish_controller_state(struct joybus_port *port, uint32_t state)
+{
+    uint32_t seq = port->poll_response_seq + 1;
+    volatile uint32_t *response = port->poll_response[seq & 1];
+
+    response[0] = N64SEND_DATA(0, 0, 16) | (state >> 16);
+    response[1] = N64SEND_DATA(0, 0, 16) | (state & 0xFFFF);
+    response[2] = 0;
+
+    __dmb();
+
+    port->poll_response_seq = seq;
+}
+
+static struct joybus_port *input_port(uint8_t dev_addr)
+{
+    if (dev_addr == 0 || dev_addr > CFG_TUH_DEVICE_MAX) {
+	return NULL;
+    }
+
+    return usb_inputs[dev_addr - 1].port;
+}
+
+static bool is_controller(uint8_t input_device)
+{
+    return input_device == USB_XPAD || input_device == USB_HID_GAMEPAD;
+}
+
+// Buttons of all devices on a port are ORed, the stick comes from the device
+// pushing its stick the furthest (the first one on a tie). Runs on core1 only,
+// core0 sees the result through publish_controller_state().
+static void merge_inputs(struct joybus_port *port)
+{
+    uint32_t buttons = 0;
+    uint32_t stick = 0;
+    int best = 0;
+
+    for (int i = 0; i < PORT_INPUTS; i++) {
+	uint32_t state = port->input_state[i];
+	int x = abs((int8_t)(state >> 8));
+	int y = abs((int8_t)state);
+	int deflection = (x > y) ? x : y;
+
+	buttons |= state & 0xFFFF0000;
+
+	if (deflection > best) {
+	    best = deflection;
+	    stick = state & 0xFFFF;
+	}
+    }
+
+    publish_controller_state(port, buttons | stick);
+}
+
+static void input_report(struct usb_input *input, uint32_t state)
+{
+    input->port->input_state[input->source] = state;
+
+    merge_inputs(input->port);
+}
+
+// The console sees the type of the first device on a port
+static void update_port_device(struct joybus_port *port)
+{
+    uint8_t input_device = USB_UNKNOWN;
+
+    for (int i = PORT_INPUTS - 1; i >= 0; i--) {
+	if (port->input_addr[i]) {
+	    input_device = usb_inputs[port->input_addr[i] - 1].input_device;
+	}
+    }
+
+    port->input_device = input_device;
+}
+
+// Free source of a port for a device, -1 if there is none. Controllers
+// share a port with other controllers, a mouse or a keyboard needs a port
+// of its own.
+static int port_source(struct joybus_port *port, uint8_t input_device, bool shared)
+{
+    int source = -1;
+
+    for (int i = PORT_INPUTS - 1; i >= 0; i--) {
+	uint8_t addr = port->input_addr[i];
+
+	if (addr == 0) {
+	    source = i;
+	} else if (!shared || !is_controller(input_device) || !is_controller(usb_inputs[addr - 1].input_device)) {
+	    return -1;
+	}
+    }
+
+    return source;
+}
+
+// Put a device on the first port from 'first' on that takes it
+static bool join_port(uint8_t dev_addr, int first, bool shared)
+{
+    struct usb_input *input = &usb_inputs[dev_addr - 1];
+
+    for (int n = 0; n < JOYBUS_PORTS; n++) {
+	struct joybus_port *port = &ports[(first + n) % JOYBUS_PORTS];
+	int source = port_source(port, input->input_device, shared);
+
+	if (source >= 0) {
+	    input->port = port;
+	    input->source = source;
+	    port->input_addr[source] = dev_addr;
+	    port->input_state[source] = 0;
+	    update_port_device(port);
+
+	    printf("Device %d plays on port %d\n", dev_addr, port->num + 1);
+	    return true;
+	}
+    }
+
+    return false;
+}
+
+static void leave_port(struct usb_input *input)
+{
+    struct joybus_port *port = input->port;
+
+    input->port = NULL;
+
+    port->input_addr[input->source] = 0;
+    port->input_state[input->source] = 0;
+    update_port_device(port);
+    merge_inputs(port);
+
+    if (port->input_device == USB_UNKNOWN) {
+	port->enable_vibro = 0;
+	port->disable_vibro = 0;
+    }
+}
+
+// Give a device the first free port, or a port shared with other
+// controllers when all are taken. NULL if no port takes it.
+static struct joybus_port *attach_input(uint8_t dev_addr, uint8_t input_device)
+{
+    struct usb_input *input;
+
+    if (dev_addr == 0 || dev_addr > CFG_TUH_DEVICE_MAX) {
+	return NULL;
+    }
+
+    input = &usb_inputs[dev_addr - 1];
+
+    if (input->port) {
+	leave_port(input);
+    }
+
+    input->input_device = input_device;
+    input->old_buttons = 0;
+    input->slot_changed = false;
+
+    if (!join_port(dev_addr, 0, false) && !join_port(dev_addr, 0, true)) {
+	printf("No free port for device %d\n", dev_addr);
+	return NULL;
+    }
+
+    tuh_vid_pid_get(dev_addr, &input->vid, &input->pid);
+
+    printf("Device %04X:%04X with address %d attached\n", input->vid, input->pid, dev_addr);
+
+    return input->port;
+}
+
+// Move a controller to the next port that takes it, merging it with the
+// controllers already there. It stays on its port when no other one does.
+static void move_input(uint8_t dev_addr)
+{
+    struct usb_input *input = &usb_inputs[dev_addr - 1];
+    int old = input->port->num;
+
+    leave_port(input);
+    if (!join_port(dev_addr, old + 1, true)) {
+	// the source it left is free
+	join_port(dev_addr, old, true);
+    }
+}
+
+void disable_input(uint8_t dev_addr)
+{
+    struct joybus_port *port = input_port(dev_addr);
+
+    if (!port) {
+	return;
+    }
+
+    leave_port(&usb_inputs[dev_addr - 1]);
+
+    printf("Device %d left port %d\n", dev_addr, port->num + 1);
+}
+
 void tuh_xpad_mount_cb(uint8_t dev_addr)
 {
-    _dev_addr = dev_addr;
+    printf("A xpad device with address %d is mounted\r\n", dev_addr);
+
+    attach_input(dev_addr, USB_XPAD);
+}
+
+void tuh_xpad_umount_cb(uint8_t dev_addr)
+{
+    printf("A xpad device with address %d is unmounted\r\n", dev_addr);
+
+    disable_input(dev_addr);
+}
+
+// Stick scale (Q12) by gate distance, the deadzone, curve and gate clamp baked in
+static uint16_t stick_scale[STICK_LUT_SIZE];
+
+static void stick_init(void)
+{
+    const float deadzone = STICK_DEADZONE / 100.0f;
+    const float saturation = STICK_SATURATION / 100.0f;
+    const float anti_deadzone = STICK_ANTI_DEADZONE / 100.0f;
+
+    for (int i = 0; i < STICK_LUT_SIZE; i++) {
+	// distance from the center in the gate shape, 1 at full tilt on an axis
+	float u = ((i << STICK_LUT_SHIFT) + (1 << (STICK_LUT_SHIFT - 1))) / (float)(STICK_GATE_DIAG * 128);
+	float v = 0;
 
-    tuh_vid_pid_get(dev_addr, &m_vid, &m_pid);
+	if (u >= deadzone) {
+	    float t = (u - deadzone) / (saturation - deadzone);
 
-    printf("A xpad device %04X:%04X with address %d is mounted\r\n", m_vid, m_pid, dev_addr);
+	    if (t > 1.0f) t = 1.0f;
+
+	    v = anti_deadzone + (1.0f - anti_deadzone) * powf(t, STICK_CURVE);
+	}
 
-    input_device = USB_XPAD;
+	// the output keeps the direction and lies at distance v inside the gate
+	stick_scale[i] = v / u * STICK_GATE / 128 * 4096 + 0.5f;
+    }
 }
 
-static int8_t analog_value(int16_t val)
+// N64 stick position from a gamepad stick. The gate distance of the
+// octagon through (G, 0) and (D, D) is (D * max + (G - D) * min) / D,
+// so a circle of the gamepad stick maps onto the N64 gate.
+static void stick_value(int16_t x, int16_t y, int8_t *n64_x, int8_t *n64_y)
 {
-    val = val / 0x190;
+    int a = abs(x >> 8);
+    int b = abs(y >> 8);
+    int hi = (a > b) ? a : b;
+    int lo = (a > b) ? b : a;
+    uint32_t scale = stick_scale[(STICK_GATE_DIAG * hi + (STICK_GATE - STICK_GATE_DIAG) * lo) >> STICK_LUT_SHIFT];
+
+    a = (a * scale + 2048) >> 12;
+    b = (b * scale + 2048) >> 12;
 
-    if (val < 10 && val > -10) return 0;
+    *n64_x = (x < 0) ? -a : a;
+    *n64_y = (y < 0) ? -b : b;
+}
 
-    if (val > 0x50) val = 0x50;
+// Previous or next slot from the one picked on a port, skipping the slots of the other ports
+static uint8_t pak_slot_step(struct joybus_port *port, int step)
+{
+    uint8_t slot = port->pak_slot_request;
 
-    if (val < -0x50) val = -0x50;
+    for (int i = 0; i < PAK_STORE_SLOTS; i++) {
+	bool taken = false;
+
+	slot = (slot + PAK_STORE_SLOTS + step) % PAK_STORE_SLOTS;
+
+	for (int p = 0; p < JOYBUS_PORTS; p++) {
+	    if (&ports[p] != port && (ports[p].pak_slot == slot || ports[p].pak_slot_request == slot)) {
+		taken = true;
+	    }
+	}
+
+	if (!taken) {
+	    break;
+	}
+    }
 
-    return val;
+    return slot;
 }
 
 void tuh_xpad_read_cb(uint8_t dev_addr, uint8_t *report, xpad_controller_t *info)
 {
-    uint8_t b = 0;
-    uint8_t b1 = 0;
+    struct joybus_port *port = input_port(dev_addr);
+    struct usb_input *input;
+    uint16_t pressed;
+    uint16_t buttons;
+    int8_t x, y;
+
+    if (!port) {
+	return;
+    }
+
+    input = &usb_inputs[dev_addr - 1];
+    pressed = info->buttons & ~input->old_buttons;
 
 //    printf("buttons %04X lx=%d ly=%d rx=%d ry=%d lt=%d rt=%d\n", info->buttons, info->lx, info->ly, info->rx, info->ry, info->lt, info->rt);
 
-    /*if (info->buttons & XPAD_HAT_UP)    b |= 0x08; // D-U    D-UP
-    if (info->buttons & XPAD_HAT_DOWN)  b |= 0x04; // D-D    D-D
-    if (info->buttons & XPAD_HAT_LEFT)  b |= 0x02; // D-L    D-L
-    if (info->buttons & XPAD_HAT_RIGHT) b |= 0x01; // D-R    D-R
-
-    if (analog_value(info->ry) > 40)    b1|= 0x08; // RS-U  C-U
-    if (analog_value(info->ry) < -40)   b1|= 0x04; // RS-D  C-D
-    if (analog_value(info->rx) < -40)   b1|= 0x02; // RS-L  C-L
-    if (analog_value(info->rx) > 40)    b1|= 0x01; // RS-R  C-R
-
-    if (info->buttons & XPAD_PAD_A)     b |= 0x80; // A      A
-    if (info->buttons & XPAD_PAD_B)     b |= 0x40; // B      B
-    if (info->lt > 512)                 b |= 0x20; // LT    Z
-    if (info->rt > 512)                 b |= 0x20; // LT    Z
-    if (info->buttons & XPAD_START)     b |= 0x10; // START  START
-
-    if (info->buttons & XPAD_PAD_LB)    b1|= 0x20; // LB      L
-    if (info->buttons & XPAD_PAD_RB)    b1|= 0x10; // RB      R
-
-    buttons[0] = b;
-    buttons[1] = b1;
-    sticks[0] = analog_value(info->lx);
-    sticks[1] = analog_value(info->ly);
-
-	*/
-
-	// D-Pad
-    if (info->buttons & XPAD_HAT_UP)    b |= 0x08;
-    if (info->buttons & XPAD_HAT_DOWN)  b |= 0x04;
-    if (info->buttons & XPAD_HAT_LEFT)  b |= 0x02;
-    if (info->buttons & XPAD_HAT_RIGHT) b |= 0x01;
-
-    // C-Buttons
-    if (info->buttons & XPAD_PAD_LB)    b1 |= 0x08; // C-Up
-    if (info->buttons & XPAD_PAD_RB)    b1 |= 0x04; // C-Down
-    if (info->lt > 512)                 b1 |= 0x02; // C-Left
-    if (info->rt > 512)                 b1 |= 0x01; // C-Right
-
-    // Standard Buttons
-    if (info->buttons & XPAD_PAD_A)     b |= 0x80; // A
-    if (info->buttons & XPAD_PAD_B)     b |= 0x40; // B
-    if (info->buttons & XPAD_PAD_X)     b |= 0x20; // Z
-    if (info->buttons & XPAD_PAD_Y)     b |= 0x10; // R
-    if (info->buttons & XPAD_STICK_L)    b1 |= 0x20; // L
-
-    // Start
-    if (info->buttons & XPAD_START)     b |= 0x10;
+    // buttons from the button map, see button_map.h
+    buttons = button_map_apply(info);
 
     // Stick-Priorisierung: linker bevorzugt
-    if (abs(analog_value(info->lx)) > 10 || abs(analog_value(info->ly)) > 10) {
-        sticks[0] = analog_value(info->lx);
-        sticks[1] = analog_value(info->ly);
-    } else {
-        sticks[0] = analog_value(info->rx);
-        sticks[1] = analog_value(info->ry);
+    stick_value(info->lx, info->ly, &x, &y);
+    if (x == 0 && y == 0) {
+        stick_value(info->rx, info->ry, &x, &y);
     }
 
-    buttons[0] = b;
-    buttons[1] = b1;
+    input_report(input, N64_STATE(buttons >> 8, buttons & 0xFF, x, y));
 
 
 
 	
 
+    // xbox button + D-Left/D-Right selects the previous/next memory pak,
+    // xbox button + D-Down moves the gamepad to the next port,
+    // the xbox button alone toggles the rumble pak when it is released
     if (info->buttons & XPAD_XLOGO) {
-	use_rumble_pack = !use_rumble_pack;
+	if (pressed & XPAD_HAT_RIGHT) {
+	    port->pak_slot_request = pak_slot_step(port, 1);
+	    input->slot_changed = true;
+	}
+	if (pressed & XPAD_HAT_LEFT) {
+	    port->pak_slot_request = pak_slot_step(port, -1);
+	    input->slot_changed = true;
+	}
+	if (pressed & XPAD_HAT_DOWN) {
+	    move_input(dev_addr);
+	    input->slot_changed = true;
+	}
+    } else if (input->old_buttons & XPAD_XLOGO) {
+	if (!input->slot_changed && input->port) {
+	    input->port->use_rumble_pack = !input->port->use_rumble_pack;
+	}
+	input->slot_changed = false;
     }
 
+    input->old_buttons = info->buttons;
+
     //debug_dump_16(report);
 }
 
+// every xbox gamepad on a port rumbles
+static void xpad_vibro(struct joybus_port *port, uint8_t on)
+{
+    for (int i = 0; i < PORT_INPUTS; i++) {
+	uint8_t addr = port->input_addr[i];
+
+	if (addr && usb_inputs[addr - 1].input_device == USB_XPAD) {
+	    tuh_xpad_vibro(addr, on);
+	}
+    }
+}
+
 static void xpad_task(void)
 {
-    if (enable_vibro == 1) {
-        if (input_device == USB_XPAD) {
-            tuh_xpad_vibro(_dev_addr, 1);
-        }
-//	printf("Start vibro\n");
-	enable_vibro = 0;
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	struct joybus_port *port = &ports[p];
+
+	if (port->enable_vibro == 1) {
+	    xpad_vibro(port, 1);
+//	    printf("Start vibro\n");
+	    port->enable_vibro = 0;
+	}
+
+	if (port->disable_vibro == 1) {
+	    xpad_vibro(port, 0);
+//	    printf("Stop vibro\n");
+	    port->disable_vibro = 0;
+	}
     }
+}
+
+static volatile bool core1_alive = false;
 
-    if (disable_vibro == 1) {
-        if (input_device == USB_XPAD) {
-            tuh_xpad_vibro(_dev_addr, 0);
-        }
-//	printf("Stop vibro\n");
-	disable_vibro = 0;
+// Check in and wake core0 up, it feeds the watchdog
+static void watchdog_task(void)
+{
+    static uint32_t start_ms = 0;
+
+    if (board_millis() - start_ms < WATCHDOG_CHECKIN_MS) return;
+    start_ms += WATCHDOG_CHECKIN_MS;
+
+    core1_alive = true;
+    __sev();
+}
+
+static bool any_rumble_pack(void)
+{
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	if (ports[p].use_rumble_pack) {
+	    return true;
+	}
     }
+
+    return false;
 }
 
+// fast blinking while the rumble pak is on for any port
 static void led_blinking_task(void)
 {
-    const uint32_t interval_ms = use_rumble_pack ? 500 : 1000;
+    const uint32_t interval_ms = any_rumble_pack() ? 500 : 1000;
     static uint32_t start_ms = 0;
 
     static bool led_state = false;
@@ -244,11 +698,16 @@ static void led_blinking_task(void)
 
 void usb_host_process(void)
 {
+    // core1 runs from flash, let core0 park it while the pak is saved
+    flash_safe_execute_core_init();
+
     tusb_init();
 
     while (1) {
 	tuh_task();
 
+	watchdog_task();
+
 	led_blinking_task();
 
 #if CFG_TUH_XPAD
@@ -258,58 +717,69 @@ void usb_host_process(void)
 #if CFG_TUH_HID
 	hid_app_task();
 #endif
-
-	if (core1_disable_irq) {
-	    uint32_t ints = save_and_disable_interrupts();
-	    multicore_fifo_push_blocking(0x4321);
-	    uint32_t g = multicore_fifo_pop_blocking();
-	    restore_interrupts(ints);
-	}
     }
 }
 
-void enable_keyboard(void)
+void enable_keyboard(uint8_t dev_addr)
 {
-    randnet_keys[0] = 0;
-    randnet_keys[1] = 0;
-    randnet_keys[2] = 0;
-    randnet_pressed = 0;
-    randnet_error = false;
-    randnet_home = false;
+    struct joybus_port *port = attach_input(dev_addr, USB_UNKNOWN);
+
+    if (!port) {
+	return;
+    }
+
+    port->randnet_keys[0] = 0;
+    port->randnet_keys[1] = 0;
+    port->randnet_keys[2] = 0;
+    port->randnet_pressed = 0;
+    port->randnet_error = false;
+    port->randnet_home = false;
 
     printf("Keyboard enabled\n");
-    input_device = USB_KEYBOARD;
+    usb_inputs[dev_addr - 1].input_device = USB_KEYBOARD;
+    port->input_device = USB_KEYBOARD;
 }
 
-void enable_mouse(void)
+void enable_mouse(uint8_t dev_addr)
 {
     printf("Mouse enabled\n");
-    input_device = USB_MOUSE;
+    attach_input(dev_addr, USB_MOUSE);
 }
 
-void enable_hid_gamepad(void)
+void enable_hid_gamepad(uint8_t dev_addr)
 {
     printf("HID gamepad enabled\n");
-    input_device = USB_HID_GAMEPAD;
+    attach_input(dev_addr, USB_HID_GAMEPAD);
 }
 
-void update_keys(uint16_t keys[3], bool error, bool home)
+void update_keys(uint8_t dev_addr, uint16_t keys[3], bool error, bool home)
 {
-    randnet_keys[0] = keys[0];
-    randnet_keys[1] = keys[1];
-    randnet_keys[2] = keys[2];
+    struct joybus_port *port = input_port(dev_addr);
+
+    if (!port) {
+	return;
+    }
+
+    port->randnet_keys[0] = keys[0];
+    port->randnet_keys[1] = keys[1];
+    port->randnet_keys[2] = keys[2];
 
-    randnet_error = error;
-    randnet_home = home;
+    port->randnet_error = error;
+    port->randnet_home = home;
 
 //    printf("%02X %02X %02X %s %s\n", randnet_keys[0], randnet_keys[1], randnet_keys[2], error ? "[ERROR]" : "", home ? "[HOME]" : "");
 }
 
-void update_mouse(uint8_t butts, int8_t x, int8_t y, int8_t wheel, int8_t acpan)
+void update_mouse(uint8_t dev_addr, uint8_t butts, int32_t x, int32_t y, int8_t wheel, int8_t acpan)
 {
+    struct joybus_port *port = input_port(dev_addr);
     uint8_t b = 0;
     uint8_t b1 = 0;
 
+    if (!port) {
+	return;
+    }
+
 //    printf("buttons=%02X x=%d y=%d wheel=%d acpan=%d\n", butts, x, y, wheel, acpan);
 
     if (butts & MOUSE_BUTTON_LEFT)   b |= 0x80; // MOUSE LB  A
@@ -319,10 +789,12 @@ void update_mouse(uint8_t butts, int8_t x, int8_t y, int8_t wheel, int8_t acpan)
     if (wheel < 0) b1 |= 0x04;                  // MOUSE W-D C-D
     if (acpan > 0) b1 |= 0x02;                  // MOUSE W-L C-L
     if (acpan < 0) b1 |= 0x01;                  // MOUSE W-R C-R
-    buttons[0] = b;
-    buttons[1] = b1;
-    sticks[0] = x;
-    sticks[1] = -y;
+
+    // every report counts, the poll takes the sum
+    port->mouse_x += (uint32_t)(x * MOUSE_SCALE);
+    port->mouse_y += (uint32_t)(-y * MOUSE_SCALE);
+
+    input_report(&usb_inputs[dev_addr - 1], N64_STATE(b, b1, 0, 0));
 }
 
 void debug_dump_16(uint8_t *ptr)
@@ -345,437 +817,1084 @@ void debug_dump_16(uint8_t *ptr)
     printf("DUMP16: %s\n", tmp);
 }
 
-static uint16_t __not_in_flash_func(calc_address_crc)(uint16_t address)
+static inline uint8_t reverse(uint8_t b)
 {
-    /* CRC table */
-    uint16_t xor_table[16] = { 0x0, 0x0, 0x0, 0x0, 0x0, 0x15, 0x1F, 0x0B, 0x16, 0x19, 0x07, 0x0E, 0x1C, 0x0D, 0x1A, 0x01 };
-    uint16_t crc = 0;
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+    return b;
+}
 
-    /* Make sure we have a valid address */
-    address &= ~0x1F;
+// Start a reply and return, n64send releases the receiver once the stop bit
+// is out. The buffer is not touched again before the next frame comes in.
+static void __not_in_flash_func(send_response)(struct joybus_port *port, const volatile uint32_t *buffer, uint32_t words)
+{
+    dma_channel_transfer_from_buffer_now(port->tx_dma_chan, buffer, words);
 
-    /* Go through each bit in the address, and if set, xor the right value into the output */
-    for(int i = 15; i >= 5; i--) {
-        /* Is this bit set? */
-        if(((address >> i) & 0x1)) {
-            crc ^= xor_table[i];
-        }
+    port->response_sent = true;
+}
+
+static void __not_in_flash_func(write_data_block)(struct joybus_port *port, const uint8_t *data_block, uint8_t crc)
+{
+    for (int i = 0; i < 32; i+= 2) {
+	port->dma_buffer[i >> 1] = N64SEND_DATA(data_block[i + 0], data_block[i + 1], 16);
     }
+    port->dma_buffer[16] = N64SEND_DATA(crc, 0x00, 8);
+    port->dma_buffer[17] = 0;
 
-    /* Just in case */
-    crc &= 0x1F;
+    send_response(port, port->dma_buffer, 18);
+}
+
+// RAM copy of a block, NULL if it has to be read from the store. Forced
+// inline, the joybus IRQ calls it while the flash is busy.
+static __force_inline uint8_t *memory_pak_ram(struct memory_pak *pak, uint32_t block)
+{
+    if (block < PAK_PINNED_BLOCKS) {
+	return pak->pinned[block];
+    }
 
-    /* Create a new address with the CRC appended */
-    return address | crc;
+    if (pak->overlay_map[block] != PAK_NO_OVERLAY) {
+	return pak_overlay.block[pak->overlay_map[block]];
+    }
+
+    return NULL;
+}
+
+static int __not_in_flash_func(overlay_first)(const uint32_t *bits)
+{
+    for (int i = 0; i < PAK_OVERLAY_BLOCKS / 32; i++) {
+	if (bits[i]) {
+	    return i * 32 + __builtin_ctz(bits[i]);
+	}
+    }
+
+    return -1;
 }
 
-static uint8_t __not_in_flash_func(calc_data_crc)( uint8_t *data )
+// Map an overlay entry to a block, a free one or else one holding a saved
+// copy of another block. NULL if every entry holds unsaved data. A saved copy
+// of the block is passed in, a block about to be written is not. The IRQs of
+// the ports have the same priority and never preempt each other, the main
+// loop calls this with interrupts disabled.
+static uint8_t *__not_in_flash_func(overlay_alloc)(struct joybus_port *port, uint32_t block, const uint8_t *saved)
 {
-    uint8_t ret = 0;
+    int n = overlay_first(pak_overlay.free);
 
-    for(int i = 0; i <= 32; i++) {
-        for(int j = 7; j >= 0; j--) {
-            int tmp = 0;
+    if (n < 0) {
+	n = overlay_first(pak_overlay.clean);
+	if (n < 0) {
+	    return NULL;
+	}
 
-            if(ret & 0x80) {
-                tmp = 0x85;
-            }
+	uint16_t owner = pak_overlay.owner[n];
 
-            ret <<= 1;
+	ports[owner >> 10].pak->overlay_map[owner & (PAK_STORE_BLOCKS - 1)] = PAK_NO_OVERLAY;
+    }
 
-            if(i < 32) {
-                if(data[i] & (0x01 << j)) {
-                    ret |= 0x1;
-                }
-            }
-            ret ^= tmp;
-        }
+    pak_overlay.free[n / 32] &= ~(1u << (n % 32));
+    if (saved) {
+	memcpy(pak_overlay.block[n], saved, 32);
+	pak_overlay.clean[n / 32] |= 1u << (n % 32);
+    } else {
+	pak_overlay.clean[n / 32] &= ~(1u << (n % 32));
     }
+    pak_overlay.owner[n] = port->num << 10 | block;
+    port->pak->overlay_map[block] = n;
 
-    return ret;
+    return pak_overlay.block[n];
 }
 
-static inline uint8_t reverse(uint8_t b)
+// RAM copy to write a block to, NULL if the overlay is full
+static uint8_t *__not_in_flash_func(memory_pak_ram_for_write)(struct joybus_port *port, uint32_t block)
 {
-    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
-    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
-    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
-    return b;
+    uint8_t *data = memory_pak_ram(port->pak, block);
+    uint8_t n = port->pak->overlay_map[block];
+
+    if (!data) {
+	return overlay_alloc(port, block, NULL);
+    }
+
+    // a saved copy is about to change, it must stay
+    if (block >= PAK_PINNED_BLOCKS) {
+	pak_overlay.clean[n / 32] &= ~(1u << (n % 32));
+    }
+
+    return data;
 }
 
-#define TICKS_1US	197UL
-//#define TICKS_1US	175
+// accessory status of the 0x00 reply
+#define PAK_STATUS_PRESENT	0x01
+#define PAK_STATUS_REMOVED	0x02
 
-static inline void wait_ticks(uint32_t count)
+// 0x00 info, 0xFF reset: device type and accessory status
+static void __not_in_flash_func(command_info)(struct joybus_port *port, uint8_t *frame)
 {
-    systick_hw->csr = 0x0;
-    systick_hw->rvr = 0xFFFFFF;
-    systick_hw->csr = 0x5;
-    uint32_t old = systick_hw->cvr;
-    while (old - systick_hw->cvr < count) {
+    // while another slot is loaded the memory pak is pulled out, the game
+    // stops using it instead of seeing failed transfers
+    uint8_t pak_status = (port->memory_pak_offline && !port->use_rumble_pack) ? PAK_STATUS_REMOVED : PAK_STATUS_PRESENT;
+
+    if (port->input_device == USB_MOUSE) {
+	port->dma_buffer[0] = N64SEND_DATA(0x02, 0x00, 16);
+	port->dma_buffer[1] = N64SEND_DATA(0x01, 0x00, 8);
+    } else if (port->input_device == USB_KEYBOARD) {
+	port->dma_buffer[0] = N64SEND_DATA(0x00, 0x02, 16);
+	port->dma_buffer[1] = N64SEND_DATA(0x01, 0x00, 8);
+    } else {
+	port->dma_buffer[0] = N64SEND_DATA(0x05, 0x00, 16);
+	port->dma_buffer[1] = N64SEND_DATA(pak_status, 0x00, 8);
     }
+    port->dma_buffer[2] = 0;
+
+    send_response(port, port->dma_buffer, 3);
 }
 
-static int __not_in_flash_func(read_data_block)(uint8_t *data_block)
+// Motion on one mouse axis not sent yet, as a stick value. A backlog of
+// more than a few polls is dropped instead of replayed for seconds.
+static __force_inline uint8_t mouse_step(uint32_t *sent, uint32_t total)
 {
-    uint8_t byte = 0;
-    int bits_read = 0;
-    int bytes_read = 0;
+    const int32_t backlog = MOUSE_BACKLOG_POLLS * 127 * MOUSE_SCALE;
+    int32_t pending = (int32_t)(total - *sent);
 
-    while (1) {
-	wait_ticks(TICKS_1US * 2);
-	byte <<= 1;
-	byte |= (gpio_get(N64_DIO_PIN) ? 1 : 0);
+    if (pending > backlog) {
+	*sent = total - backlog;
+    } else if (pending < -backlog) {
+	*sent = total + backlog;
+    }
 
-	bits_read++;
+    int32_t steps = (int32_t)(total - *sent) / MOUSE_SCALE;
 
-	if (bits_read == 8) {
-	    data_block[bytes_read++] = byte;
-	    byte = 0;
-	    bits_read = 0;
-	    if (bytes_read == 32) {
-//		wait_ticks(TICKS_1US * 2); // console stop bit
-//		wait_ticks(TICKS_1US);     //
-		uint8_t crc = calc_data_crc(data_block);
-//		wait_ticks(TICKS_1US * 3);
+    if (steps > 127) steps = 127;
+    if (steps < -127) steps = -127;
 
-		dma_buffer[0] = N64SEND_DATA(crc, 0x00, 8);
-		dma_buffer[1] = 0;
+    *sent += (uint32_t)(steps * MOUSE_SCALE);
 
+    return (uint8_t)steps;
+}
 
-		pio_sm_exec(pio, sm, pio_encode_jmp(pio_offset + n64send_dma_offset_loop));
+// 0x01: controller state
+static void __not_in_flash_func(command_poll)(struct joybus_port *port, uint8_t *frame)
+{
+    uint32_t now = time_us_32();
 
-		dma_channel_transfer_from_buffer_now(pio_dma_chan, dma_buffer, 2);
-		dma_channel_wait_for_finish_blocking(pio_dma_chan);
+    if (now - port->poll_time_us < POLL_IDLE_US) {
+	port->poll_interval_us = now - port->poll_time_us;
+    } else {
+	// the mouse moved while nobody polled, the game starts from rest
+	port->mouse_sent_x = port->mouse_x;
+	port->mouse_sent_y = port->mouse_y;
+    }
+    port->poll_time_us = now;
+
+    if (port->input_device != USB_KEYBOARD) {
+	uint32_t seq = port->poll_response_seq;
+	const volatile uint32_t *response = port->poll_response[seq & 1];
+
+	if (port->input_device == USB_MOUSE) {
+	    // mouse motion is relative, report what moved since the last poll
+	    port->dma_buffer[0] = response[0];
+	    port->dma_buffer[1] = N64SEND_DATA(mouse_step(&port->mouse_sent_x, port->mouse_x),
+					       mouse_step(&port->mouse_sent_y, port->mouse_y), 16);
+	    port->dma_buffer[2] = 0;
+	    response = port->dma_buffer;
+	}
 
-		while (pio_sm_get_pc(pio, sm) != (pio_offset + n64send_dma_offset_stop)) {}
+	send_response(port, response, 3);
+    }
+}
 
-		return bytes_read;
-	    }
+// 0x02: accessory read
+static void __not_in_flash_func(command_read)(struct joybus_port *port, uint8_t *frame)
+{
+    uint16_t address = (frame[1] << 8) | frame[2];
+    uint32_t addr = address & 0xFFE0;
+
+    if (!n64_crc_address_valid(address)) {
+	// an inverted data CRC never matches, the console sees a failed transfer and retries
+	port->pak_read_addr_errors++;
+	memset(port->data_block, 0x00, 32);
+	write_data_block(port, port->data_block, 0xFF);
+    } else if (addr < 0x8000 && !port->memory_pak_offline) {
+	const uint8_t *data = memory_pak_ram(port->pak, addr >> 5);
+	bool from_store = !data && !flash_busy;
+
+	if (from_store) {
+	    pak_store_read(port->num, addr >> 5, port->data_block);
+	    data = port->data_block;
 	}
 
-	int timeout = 300;
-	while(!gpio_get(N64_DIO_PIN) && timeout--) {
+	if (data) {
+	    write_data_block(port, data, port->pak->crc[addr >> 5]);
+	    port->memory_pak_access_us = time_us_32();
+	    port->memory_pak_read_block = addr >> 5;
+	} else {
+	    // not one of the blocks pak_snapshot() keeps in RAM while the flash
+	    // is busy, the console sees a failed transfer
+	    memset(port->data_block, 0x00, 32);
+	    write_data_block(port, port->data_block, 0xFF);
 	}
 
-	if (timeout != 0) {
-	    timeout = 300;
-	    while(gpio_get(N64_DIO_PIN) && timeout--) {
-	    }
+	// games read a file again or write the block next
+	if (from_store) {
+	    overlay_alloc(port, addr >> 5, port->data_block);
 	}
+    } else if (port->use_rumble_pack && addr == 0x8000) {
+	memset(port->data_block, 0x80, 32);
+	write_data_block(port, port->data_block, rumble_block_crc);
+    } else {
+	// the CRC of an all zero block is zero
+	memset(port->data_block, 0x00, 32);
+	write_data_block(port, port->data_block, 0x00);
+    }
+}
 
-	if (timeout == 0) {
-	    return -3;
+// 0x03: accessory write
+static void __not_in_flash_func(command_write)(struct joybus_port *port, uint8_t *frame)
+{
+    uint16_t address = (frame[1] << 8) | frame[2];
+    uint32_t addr = address & 0xFFE0;
+    bool addr_valid = n64_crc_address_valid(address);
+    bool accepted = addr_valid;
+    uint8_t *data = NULL;
+    uint8_t crc = n64_crc_data(&frame[3]);
+
+    if (addr_valid && addr < 0x8000 && !port->memory_pak_offline) {
+	data = memory_pak_ram_for_write(port, addr >> 5);
+	accepted = data != NULL;
+	if (!accepted) {
+	    pak_overlay_full = true;
+	}
+    }
+
+    port->dma_buffer[0] = N64SEND_DATA(accepted ? crc : crc ^ 0xFF, 0x00, 8);
+    port->dma_buffer[1] = 0;
+
+    send_response(port, port->dma_buffer, 2);
+
+    if (!addr_valid) {
+	// never write a block to a corrupted address
+	port->pak_write_addr_errors++;
+    } else if (data) {
+	// memcpy is in RAM with PICO_MEM_IN_RAM, memmove never is
+	memcpy(data, &frame[3], 32);
+	port->pak->crc[addr >> 5] = crc;
+	port->pak->dirty[addr >> 10] |= 1u << ((addr >> 5) & 31);
+	port->pak_staged[addr >> 10] &= ~(1u << ((addr >> 5) & 31));
+	port->memory_pak_write_us = port->memory_pak_access_us = time_us_32();
+    } else if (port->use_rumble_pack && addr == 0xC000) {
+	if (frame[3] == 0x00) {
+	    // stop rumble pack
+	    port->disable_vibro = 1;
+	} else {
+	    // start rumble pack
+	    port->enable_vibro = 1;
 	}
     }
 }
 
-static int __not_in_flash_func(write_data_block)(uint8_t *data_block)
+// 0x13: randnet keyboard keys, the console sends the LED state
+static void __not_in_flash_func(command_keyboard)(struct joybus_port *port, uint8_t *frame)
 {
-    uint8_t crc = calc_data_crc(data_block);
+    port->randnet_led_status = frame[1];
 
-    for (int i = 0; i < 32; i+= 2) {
-	dma_buffer[i >> 1] = N64SEND_DATA(data_block[i + 0], data_block[i + 1], 16);
+    uint8_t *ptr = (uint8_t *)port->randnet_keys;
+
+    port->dma_buffer[0] = N64SEND_DATA(ptr[1], ptr[0], 16);
+    port->dma_buffer[1] = N64SEND_DATA(ptr[3], ptr[2], 16);
+    port->dma_buffer[2] = N64SEND_DATA(ptr[5], ptr[4], 16);
+    port->dma_buffer[3] = N64SEND_DATA(((port->randnet_error ? 0x10 : 0x00) | (port->randnet_home ? 0x01 : 0x00)), 0, 8);
+    port->dma_buffer[4] = 0;
+
+    send_response(port, port->dma_buffer, 5);
+}
+
+struct joybus_command {
+    // whole frame including the command byte, 0 for commands we do not answer
+    uint8_t len;
+    void (*handler)(struct joybus_port *port, uint8_t *frame);
+};
+
+// Indexed by the command byte, in RAM like the IRQ
+static const struct joybus_command __not_in_flash("joybus") joybus_commands[256] = {
+    [0x00] = { 1,  command_info },
+    [0x01] = { 1,  command_poll },
+    [0x02] = { 3,  command_read },
+    [0x03] = { 35, command_write },
+    [0x13] = { 2,  command_keyboard },
+    [0xFF] = { 1,  command_info },
+};
+
+static void __not_in_flash_func(process_command)(struct joybus_port *port, uint8_t *frame, int len)
+{
+    const struct joybus_command *command = &joybus_commands[frame[0]];
+
+    if (command->len == len) {
+	command->handler(port, frame);
+    } else {
+	port->unknown_commands++;
     }
-    dma_buffer[16] = N64SEND_DATA(crc, 0x00, 8);
-    dma_buffer[17] = 0;
+}
+
+static __force_inline void joybus_irq(struct joybus_port *port)
+{
+    pio_interrupt_clear(port->pio, port->rx_sm);
+
+    // let the DMA drain the last byte(s) of the frame
+    while (!pio_sm_is_rx_fifo_empty(port->pio, port->rx_sm)) {}
+    __compiler_memory_barrier();
 
-    pio_sm_exec(pio, sm, pio_encode_jmp(pio_offset + n64send_dma_offset_loop));
+    int len = RX_DMA_COUNT - dma_channel_hw_addr(port->rx_dma_chan)->transfer_count;
 
-    dma_channel_transfer_from_buffer_now(pio_dma_chan, dma_buffer, 18);
-    dma_channel_wait_for_finish_blocking(pio_dma_chan);
+    // rewind the receive buffer, nothing comes in until the receiver is released
+    dma_channel_abort(port->rx_dma_chan);
+    dma_channel_transfer_to_buffer_now(port->rx_dma_chan, port->rx_buffer, RX_DMA_COUNT);
+
+    port->response_sent = false;
+    port->frame_us = time_us_32();
+
+    if (len > 0 && len <= sizeof(port->rx_buffer)) {
+	process_command(port, port->rx_buffer, len);
+    }
 
-    while (pio_sm_get_pc(pio, sm) != (pio_offset + n64send_dma_offset_stop)) {}
+    // no reply, let the receiver listen for the next frame right away
+    if (!port->response_sent) {
+	port->pio->irq_force = 1u << (4 + port->rx_sm);
+    }
 }
 
-static uint32_t __not_in_flash_func(read_command)()
+// Every port has an NVIC line of its own (PIOx_IRQ_0/1), so no handler has
+// to find out which port it serves
+static void __not_in_flash_func(joybus_irq_handler_0)(void)
 {
-    int bits_read = 0;
-    uint32_t command = 0;
-    int timeout;
+    joybus_irq(&ports[0]);
+}
 
-    while (1) {
-	wait_ticks(TICKS_1US * 2);
-	command <<= 1;
-	command |= (gpio_get(N64_DIO_PIN) ? 1 : 0);
-
-	bits_read++;
-
-	if (bits_read == 9) {
-	    // if not command 0x02 and 0x03
-	    if ((command >> 1) != 0x02 && (command >> 1) != 0x03 && (command >> 1) != 0x13) {
-		command >>= 1;
-
-		wait_ticks(TICKS_1US * 4);
-
-		if (command == 0x00 || command == 0xFF) {
-		    if (input_device == USB_MOUSE) {
-			dma_buffer[0] = N64SEND_DATA(0x02, 0x00, 16);
-			dma_buffer[1] = N64SEND_DATA(0x01, 0x00, 8);
-		    } else if (input_device == USB_KEYBOARD) {
-			dma_buffer[0] = N64SEND_DATA(0x00, 0x02, 16);
-			dma_buffer[1] = N64SEND_DATA(0x01, 0x00, 8);
-		    } else {
-			dma_buffer[0] = N64SEND_DATA(0x05, 0x00, 16);
-			dma_buffer[1] = N64SEND_DATA(0x01, 0x00, 8);
-		    }
-		    dma_buffer[2] = 0;
-
-		    pio_sm_exec(pio, sm, pio_encode_jmp(pio_offset + n64send_dma_offset_loop));
-
-		    dma_channel_transfer_from_buffer_now(pio_dma_chan, dma_buffer, 3);
-		    dma_channel_wait_for_finish_blocking(pio_dma_chan);
-
-		    while (pio_sm_get_pc(pio, sm) != (pio_offset + n64send_dma_offset_stop)) {}
-		} else if (command == 0x01) {
-		    if (input_device != USB_KEYBOARD) {
-			dma_buffer[0] = N64SEND_DATA(buttons[0], buttons[1], 16);
-			dma_buffer[1] = N64SEND_DATA(sticks[0], sticks[1], 16);
-			dma_buffer[2] = 0;
-
-			pio_sm_exec(pio, sm, pio_encode_jmp(pio_offset + n64send_dma_offset_loop));
-
-			dma_channel_transfer_from_buffer_now(pio_dma_chan, dma_buffer, 3);
-			dma_channel_wait_for_finish_blocking(pio_dma_chan);
-
-			while (pio_sm_get_pc(pio, sm) != (pio_offset + n64send_dma_offset_stop)) {}
-
-			if (input_device == USB_MOUSE) {
-			    sticks[0] = 0;
-			    sticks[1] = 0;
-			}
-		    }
-		} else {
-		    printf("Unk cmd %X\n", command);
-		}
-
-		return command;
-	    }
+#if JOYBUS_PORTS > 1
+static void __not_in_flash_func(joybus_irq_handler_1)(void)
+{
+    joybus_irq(&ports[1]);
+}
+#endif
+
+#if JOYBUS_PORTS > 2
+static void __not_in_flash_func(joybus_irq_handler_2)(void)
+{
+    joybus_irq(&ports[2]);
+}
+#endif
+
+#if JOYBUS_PORTS > 3
+static void __not_in_flash_func(joybus_irq_handler_3)(void)
+{
+    joybus_irq(&ports[3]);
+}
+#endif
+
+static const irq_handler_t joybus_irq_handlers[JOYBUS_PORTS] = {
+    joybus_irq_handler_0,
+#if JOYBUS_PORTS > 1
+    joybus_irq_handler_1,
+#endif
+#if JOYBUS_PORTS > 2
+    joybus_irq_handler_2,
+#endif
+#if JOYBUS_PORTS > 3
+    joybus_irq_handler_3,
+#endif
+};
+
+// PIO0_IRQ_0, PIO0_IRQ_1, PIO1_IRQ_0, PIO1_IRQ_1
+static inline uint joybus_irq_num(uint8_t port)
+{
+    return PIO0_IRQ_0 + port;
+}
+
+//--------------------------------------------------------------------+
+// Memory pak saving
+//--------------------------------------------------------------------+
+
+// pico_flash normally disables all interrupts on the core that writes the
+// flash. The joybus IRQ and everything it calls run from RAM, so it stays
+// enabled and the console keeps getting answers while a sector is erased or
+// programmed. Core1 (USB) runs from flash and is locked out.
+#define JOYBUS_IRQ_MASK		(((1u << JOYBUS_PORTS) - 1) << PIO0_IRQ_0)
+
+static uint32_t flash_irq_mask;
+
+static bool flash_core_init_deinit(bool init)
+{
+    if (init) {
+	multicore_lockout_victim_init();
+    }
+
+    return init;
+}
+
+static int flash_enter_safe_zone(uint32_t timeout_ms)
+{
+    if (!multicore_lockout_start_timeout_us(timeout_ms * 1000ull)) {
+	return PICO_ERROR_TIMEOUT;
+    }
+
+    flash_irq_mask = nvic_hw->iser & ~JOYBUS_IRQ_MASK;
+    nvic_hw->icer = flash_irq_mask;
+
+    flash_busy = true;
+
+    return PICO_OK;
+}
+
+static int flash_exit_safe_zone(uint32_t timeout_ms)
+{
+    flash_busy = false;
+
+    nvic_hw->iser = flash_irq_mask;
+
+    return multicore_lockout_end_timeout_us(timeout_ms * 1000ull) ? PICO_OK : PICO_ERROR_TIMEOUT;
+}
+
+static flash_safety_helper_t joybus_flash_safety_helper = {
+    .core_init_deinit = flash_core_init_deinit,
+    .enter_safe_zone_timeout_ms = flash_enter_safe_zone,
+    .exit_safe_zone_timeout_ms = flash_exit_safe_zone
+};
+
+flash_safety_helper_t *get_flash_safety_helper(void)
+{
+    return &joybus_flash_safety_helper;
+}
+
+// Right after a poll the console leaves the line alone for most of a frame
+static bool in_poll_gap(struct joybus_port *port, uint32_t now)
+{
+    uint32_t since_poll = now - port->poll_time_us;
+
+    return since_poll > POLL_IDLE_US || since_poll < port->poll_interval_us / 2;
+}
+
+static bool pak_dirty(struct memory_pak *pak)
+{
+    for (int i = 0; i < count_of(pak->dirty); i++) {
+	if (pak->dirty[i]) {
+	    return true;
 	}
+    }
+
+    return false;
+}
 
-	timeout = 300;
-	while(!gpio_get(N64_DIO_PIN) && timeout--) {
+static bool any_pak_dirty(void)
+{
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	if (pak_dirty(ports[p].pak)) {
+	    return true;
 	}
+    }
 
-	if (timeout != 0) {
-	    timeout = 300;
-	    while(gpio_get(N64_DIO_PIN) && timeout--) {
+    return false;
+}
+
+// Hand the dirty blocks of a port to the store until it has no room left.
+// They stay dirty until the store has programmed them, a watchdog reboot
+// before that resumes them.
+static void pak_flush_blocks(struct joybus_port *port)
+{
+    struct memory_pak *pak = port->pak;
+
+    for (int i = 0; i < count_of(pak->dirty); i++) {
+	uint32_t pending;
+
+	while ((pending = pak->dirty[i] & ~port->pak_staged[i])) {
+	    int b = __builtin_ctz(pending);
+	    uint32_t bit = 1u << b;
+	    int block = i * 32 + b;
+
+	    // a write from the IRQ after this clears the bit again
+	    uint32_t ints = save_and_disable_interrupts();
+	    port->pak_staged[i] |= bit;
+	    restore_interrupts(ints);
+
+	    if (!pak_store_write(port->num, block, memory_pak_ram(pak, block))) {
+		ints = save_and_disable_interrupts();
+		port->pak_staged[i] &= ~bit;
+		restore_interrupts(ints);
+		return;
 	    }
 	}
+    }
+}
 
-	if (timeout == 0) {
-	    return -1;
+// The store has programmed everything it was handed. The blocks not written
+// again since are saved, their overlay entries hold saved copies now.
+static void pak_commit_blocks(struct joybus_port *port)
+{
+    struct memory_pak *pak = port->pak;
+
+    for (int i = 0; i < count_of(pak->dirty); i++) {
+	if (!port->pak_staged[i]) {
+	    continue;
 	}
 
-	// command 0x03 + address 2 bytes
-	if (bits_read == 24) {
-	    if ((command >> 16) == 0x03) {
-		if (read_data_block(data_block) != 32) {
-		    return -2;
-		}
-
-		uint32_t addr = command & 0xFFE0;
-
-		if (addr < 0x8000) {
-		    memmove(&memory_pak[addr], data_block, 32);
-		    memory_pak_changed = 1;
-		} else if (use_rumble_pack && (command & 0xFFE0) == 0xC000) {
-		    if (data_block[0] == 0x00) {
-			// stop rumble pack
-			disable_vibro = 1;
-		    } else {
-			// start rumble pack
-			enable_vibro = 1;
-		    }
-		}
-	    } else {
-		wait_ticks(TICKS_1US * 3); // skip console stop bit
-
-		uint32_t addr = command & 0xFFE0;
-
-		if (addr < 0x8000) {
-		    memmove(data_block, &memory_pak[addr], 32);
-		} else if (use_rumble_pack && (command & 0xFFE0) == 0x8000) {
-		    memset(data_block, 0x80, 32);
-		} else {
-		    memset(data_block, 0x00, 32);
-		}
-		write_data_block(data_block);
+	uint32_t ints = save_and_disable_interrupts();
+	uint32_t saved = port->pak_staged[i];
+
+	pak->dirty[i] &= ~saved;
+	port->pak_staged[i] = 0;
+
+	for (; saved; saved &= saved - 1) {
+	    int block = i * 32 + __builtin_ctz(saved);
+
+	    if (block >= PAK_PINNED_BLOCKS) {
+		uint8_t n = pak->overlay_map[block];
+
+		pak_overlay.clean[n / 32] |= 1u << (n % 32);
 	    }
-	    return command;
-	} else if (bits_read == 16) {
-	    if ((command >> 8) == 0x13) {
-		wait_ticks(TICKS_1US * 3); // skip console stop bit
+	}
+	restore_interrupts(ints);
+    }
+}
 
-		randnet_led_status = command & 0xff;
+// Keep a saved block in the overlay if it has room
+static void pak_cache_block(struct joybus_port *port, uint32_t block)
+{
+    uint8_t data[32];
 
-		uint8_t *ptr = (uint8_t *)randnet_keys;
+    if (block >= PAK_STORE_BLOCKS || memory_pak_ram(port->pak, block)) {
+	return;
+    }
 
-		dma_buffer[0] = N64SEND_DATA(ptr[1], ptr[0], 16);
-		dma_buffer[1] = N64SEND_DATA(ptr[3], ptr[2], 16);
-		dma_buffer[2] = N64SEND_DATA(ptr[5], ptr[4], 16);
-		dma_buffer[3] = N64SEND_DATA(((randnet_error ? 0x10 : 0x00) | (randnet_home ? 0x01 : 0x00)), 0, 8);
-		dma_buffer[4] = 0;
+    pak_store_read(port->num, block, data);
 
-		pio_sm_exec(pio, sm, pio_encode_jmp(pio_offset + n64send_dma_offset_loop));
+    // the IRQ may have read or written it meanwhile
+    uint32_t ints = save_and_disable_interrupts();
+    if (!memory_pak_ram(port->pak, block)) {
+	overlay_alloc(port, block, data);
+    }
+    restore_interrupts(ints);
+}
 
-		dma_channel_transfer_from_buffer_now(pio_dma_chan, dma_buffer, 5);
-		dma_channel_wait_for_finish_blocking(pio_dma_chan);
+// A pak read that misses RAM fails while the flash is busy. Games read a
+// file in order, so before a flash operation the rest of the pak page read
+// last and the page after it in the index table (page 1, one bank) are
+// copied to the overlay.
+static void pak_snapshot(struct joybus_port *port)
+{
+    uint32_t block = port->memory_pak_read_block;
+    uint32_t page = block / 8;
+    uint32_t next;
+
+    if (port->memory_pak_offline || page < 5) {
+	return;
+    }
 
-		while (pio_sm_get_pc(pio, sm) != (pio_offset + n64send_dma_offset_stop)) {}
+    for (uint32_t b = block + 1; b < (page + 1) * 8; b++) {
+	pak_cache_block(port, b);
+    }
+
+    // index entries are 2 bytes: bank, next page
+    next = port->pak->pinned[8 + page / 16][(page % 16) * 2 + 1];
+    if (next >= 5 && next < PAK_STORE_BLOCKS / 8) {
+	for (uint32_t b = next * 8; b < (next + 1) * 8; b++) {
+	    pak_cache_block(port, b);
+	}
+    }
+}
+
+// Give up the saved blocks of a port that switches to another slot
+static void pak_release(struct joybus_port *port)
+{
+    struct memory_pak *pak = port->pak;
+
+    for (int i = PAK_PINNED_BLOCKS; i < PAK_STORE_BLOCKS; i++) {
+	uint8_t n = pak->overlay_map[i];
+
+	if (n != PAK_NO_OVERLAY) {
+	    uint32_t ints = save_and_disable_interrupts();
+	    pak->overlay_map[i] = PAK_NO_OVERLAY;
+	    pak_overlay.clean[n / 32] &= ~(1u << (n % 32));
+	    pak_overlay.free[n / 32] |= 1u << (n % 32);
+	    restore_interrupts(ints);
+	}
+    }
+}
+
+static void pak_flush_task(void)
+{
+    uint32_t now = time_us_32();
+    bool full = pak_overlay_full;
+    bool quiet = true;
+    bool idle = true;
+
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	struct joybus_port *port = &ports[p];
+
+	// the console is turned off or waits for room: save now, otherwise
+	// wait for the game to finish writing
+	if (full || !gpio_get(port->pin) || now - port->memory_pak_write_us >= PAK_FLUSH_DELAY_US) {
+	    pak_flush_blocks(port);
+	}
+
+	quiet &= in_poll_gap(port, now) && now - port->memory_pak_access_us >= PAK_IDLE_US;
+	idle &= now - port->frame_us >= CONSOLE_IDLE_US;
+    }
+
+    // A pak read that misses RAM fails during a flash operation, the blocks
+    // the console reads next are copied to RAM first. Page programs still
+    // wait for a quiet moment unless refused writes need the room now.
+    // Erases take long and wait until the console is off or not talking to
+    // any controller.
+    if (pak_store_busy() && (quiet || idle || full)) {
+	for (int p = 0; p < JOYBUS_PORTS; p++) {
+	    pak_snapshot(&ports[p]);
+	}
+	pak_store_step(idle);
+    }
+
+    if (!pak_store_pending()) {
+	for (int p = 0; p < JOYBUS_PORTS; p++) {
+	    pak_commit_blocks(&ports[p]);
+	}
+    }
+
+    // the console gets its writes in again
+    for (int i = 0; full && i < count_of(pak_overlay.free); i++) {
+	if (pak_overlay.free[i] | pak_overlay.clean[i]) {
+	    pak_overlay_full = full = false;
+	}
+    }
+}
+
+// Pin the metadata blocks of the slot in use and cache the CRC of every block.
+// On resume the blocks already in RAM are kept.
+static void pak_load(struct joybus_port *port, bool resume)
+{
+    uint8_t data[32];
+
+    for (int i = 0; i < PAK_STORE_BLOCKS; i++) {
+	uint8_t *block = memory_pak_ram(port->pak, i);
+
+	if (resume && block) {
+	    continue;
+	}
+
+	if (!block) {
+	    block = data;
+	}
+
+	pak_store_read(port->num, i, block);
+	port->pak->crc[i] = n64_crc_data(block);
+    }
+}
+
+static void pak_reset(struct memory_pak *pak)
+{
+    memset((void *) pak->dirty, 0, sizeof(pak->dirty));
+    memset(pak->overlay_map, 0xFF, sizeof(pak->overlay_map));
+}
+
+static uint8_t pak_resume_crc(void)
+{
+    uint8_t crc = 0;
+
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	crc = n64_crc_update(crc, pak_resume.slot[p]);
+	crc = n64_crc_update(crc, pak_resume.use_rumble_pack[p]);
+    }
+
+    return crc;
+}
+
+// Record the settings for a watchdog reboot, only the main loop calls this
+static void pak_resume_update(void)
+{
+    bool changed = pak_resume.magic != PAK_RESUME_MAGIC;
+
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	changed |= pak_resume.slot[p] != ports[p].pak_slot;
+	changed |= pak_resume.use_rumble_pack[p] != ports[p].use_rumble_pack;
+    }
+
+    if (!changed) {
+	return;
+    }
+
+    pak_resume.magic = 0;
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	pak_resume.slot[p] = ports[p].pak_slot;
+	pak_resume.use_rumble_pack[p] = ports[p].use_rumble_pack;
+    }
+    pak_resume.crc = pak_resume_crc();
+    pak_resume.magic = PAK_RESUME_MAGIC;
+}
+
+static bool pak_resume_header_valid(void)
+{
+    return pak_resume.magic == PAK_RESUME_MAGIC && pak_resume.crc == pak_resume_crc();
+}
+
+// The blocks of a port are replaced by another slot, a reboot from now on
+// must not resume them. pak_resume_update() records the new slot.
+static void pak_resume_drop(struct joybus_port *port)
+{
+    if (!pak_resume_header_valid()) {
+	return;
+    }
+
+    pak_resume.magic = 0;
+    pak_resume.slot[port->num] = PAK_STORE_SLOTS;
+    pak_resume.crc = pak_resume_crc();
+    pak_resume.magic = PAK_RESUME_MAGIC;
+}
+
+// Check the RAM state a port left in the last run, false if it has to be
+// reloaded. overlay_used holds the overlay entries of the ports resumed so
+// far, the ones of this port are added.
+static bool pak_resume_valid(struct joybus_port *port, uint32_t *overlay_used)
+{
+    struct memory_pak *pak = port->pak;
+    uint32_t used[count_of(pak_overlay.free)];
+
+    memcpy(used, overlay_used, sizeof(used));
+
+    if (pak_resume.slot[port->num] != port->pak_slot) {
+	return false;
+    }
+
+    for (int i = 0; i < PAK_STORE_BLOCKS; i++) {
+	uint8_t n = pak->overlay_map[i];
+
+	if (n != PAK_NO_OVERLAY) {
+	    // an entry mapped twice or a block in both places is garbage
+	    if (n >= PAK_OVERLAY_BLOCKS || i < PAK_PINNED_BLOCKS || (used[n / 32] & (1u << (n % 32)))) {
+		return false;
+	    }
+	    used[n / 32] |= 1u << (n % 32);
+	}
+
+	if (pak->dirty[i / 32] & (1u << (i % 32))) {
+	    if (!memory_pak_ram(pak, i)) {
+		return false;
+	    }
+	}
+
+	if (memory_pak_ram(pak, i) && n64_crc_data(memory_pak_ram(pak, i)) != pak->crc[i]) {
+	    return false;
+	}
+    }
+
+    memcpy(overlay_used, used, sizeof(used));
+
+    // entries of blocks not written since they were saved hold saved copies
+    for (int i = PAK_PINNED_BLOCKS; i < PAK_STORE_BLOCKS; i++) {
+	uint8_t n = pak->overlay_map[i];
+
+	if (n != PAK_NO_OVERLAY) {
+	    pak_overlay.owner[n] = port->num << 10 | i;
+	    if (!(pak->dirty[i / 32] & (1u << (i % 32)))) {
+		pak_overlay.clean[n / 32] |= 1u << (n % 32);
 	    }
 	}
     }
+
+    return true;
 }
 
-static void __not_in_flash_func(gpio_irq_handler)(void)
+static void pak_select_task(struct joybus_port *port)
 {
-    io_irq_ctrl_hw_t *irq_ctrl_base = get_core_num() ?
-                                           &iobank0_hw->proc1_irq_ctrl : &iobank0_hw->proc0_irq_ctrl;
+    uint8_t slot = port->pak_slot_request;
 
-    uint gpio = N64_DIO_PIN;
-    io_ro_32 *status_reg = &irq_ctrl_base->ints[gpio / 8];
-    uint events = (*status_reg >> 4 * (gpio % 8)) & 0xf;
+    if (slot == port->pak_slot) {
+	return;
+    }
 
-    if (events & GPIO_IRQ_EDGE_FALL) {
-	uint32_t cmd = read_command();
+    // two controllers picked the same pak at once, the first one gets it
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	if (&ports[p] != port && ports[p].pak_slot == slot) {
+	    port->pak_slot_request = port->pak_slot;
+	    return;
+	}
+    }
 
-//	if (cmd != 0x00 && cmd != 0x01) {
-//	printf(": %X\n", cmd);
-//	}
+    // the pak looks pulled out until the other one is in place
+    port->memory_pak_offline = true;
 
-        gpio_acknowledge_irq(gpio, events);
-    } else {
-	printf("unk irq\n");
+    // what the game wrote belongs to the old slot, pak_flush_task() saves it
+    pak_flush_blocks(port);
+    if (pak_dirty(port->pak) || !pak_store_select(port->num, slot)) {
+	return;
+    }
+
+    pak_resume_drop(port);
+    pak_release(port);
+    pak_load(port, false);
+
+    port->pak_slot = slot;
+    port->memory_pak_offline = false;
+
+    printf("Port %d: memory pak slot %d\n", port->num + 1, slot);
+}
+
+static bool pak_slot_pending(void)
+{
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	if (ports[p].pak_slot_request != ports[p].pak_slot) {
+	    return true;
+	}
     }
+
+    return false;
 }
 
 static void __not_in_flash_func(main_loop)(void)
 {
+    uint32_t addr_errors_reported[JOYBUS_PORTS] = { 0 };
+    uint32_t unknown_commands_reported[JOYBUS_PORTS] = { 0 };
+
     while(1) {
-#ifdef USE_GPIO_IRQ
-	__wfi();
+#ifdef USE_JOYBUS_IRQ
+	// keep spinning while a save is pending, the console may be off and
+	// quiet. Core1 wakes the core up to feed the watchdog.
+	if (!any_pak_dirty() && !pak_store_busy() && !pak_slot_pending()) {
+	    __wfe();
+	}
 #else
-	while(!gpio_get(N64_DIO_PIN)) {
+	for (int p = 0; p < JOYBUS_PORTS; p++) {
+	    if (pio_interrupt_get(ports[p].pio, ports[p].rx_sm)) {
+		joybus_irq(&ports[p]);
+	    }
 	}
+#endif
+	for (int p = 0; p < JOYBUS_PORTS; p++) {
+	    struct joybus_port *port = &ports[p];
 
-	while(gpio_get(N64_DIO_PIN)) {
-	}
+	    if (port->pak_read_addr_errors + port->pak_write_addr_errors != addr_errors_reported[p]) {
+		addr_errors_reported[p] = port->pak_read_addr_errors + port->pak_write_addr_errors;
+		printf("Port %d: bad pak address CRC: %d reads, %d writes rejected\n", p + 1, port->pak_read_addr_errors, port->pak_write_addr_errors);
+	    }
 
-	uint32_t cmd = read_command();
-#endif
-	if (!gpio_get(N64_DIO_PIN) && memory_pak_changed) {
-	    printf("Save memory pak: flash erase ... ");
-	    uint32_t ints = save_and_disable_interrupts();
-	    core1_disable_irq = true;
-	    uint32_t g = multicore_fifo_pop_blocking();
+	    if (port->unknown_commands != unknown_commands_reported[p]) {
+		unknown_commands_reported[p] = port->unknown_commands;
+		printf("Port %d: unknown commands: %d\n", p + 1, port->unknown_commands);
+	    }
 
+	    pak_select_task(port);
+	}
 
-	    flash_range_erase(FLASH_TARGET_OFFSET, FLASH_TARGET_SIZE);
-	    printf("write ... ");
-	    flash_range_program(FLASH_TARGET_OFFSET, memory_pak, FLASH_TARGET_SIZE);
+	pak_flush_task();
 
-	    memory_pak_changed = 0;
-	    core1_disable_irq = false;
+	pak_resume_update();
 
-	    multicore_fifo_push_blocking(0x1234);
-	    restore_interrupts (ints);
-	    printf("done\n");
+	if (core1_alive) {
+	    core1_alive = false;
+	    watchdog_update();
 	}
     }
 }
 
-int main(void)
+// Ports 1-2 run on pio0, 3-4 on pio1, each as an n64send/n64recv SM pair
+static void joybus_port_init(struct joybus_port *port, uint8_t num, float clkdiv)
 {
-    set_sys_clock_khz(200000, true);
+    static uint tx_offset[NUM_PIOS];
+    static uint rx_offset[NUM_PIOS];
+    static bool loaded[NUM_PIOS];
+
+    port->num = num;
+    port->pin = N64_DIO_PIN + num;
+    port->pio = num < 2 ? pio0 : pio1;
+    // n64send releases the receiver through a relative IRQ, rx_sm has to be sm + 1
+    port->sm = (num % 2) * 2;
+    port->rx_sm = port->sm + 1;
+    port->pak = &memory_paks[num];
+
+    publish_controller_state(port, N64_STATE(0, 0, 0, 0));
+
+    PIO pio = port->pio;
+    uint pio_index = pio_get_index(pio);
+
+    if (!loaded[pio_index]) {
+	tx_offset[pio_index] = pio_add_program(pio, &n64send_dma_program);
+	rx_offset[pio_index] = pio_add_program(pio, &n64recv_program);
+	loaded[pio_index] = true;
+    }
 
-    board_init();
+    gpio_init(port->pin);
+    gpio_put(port->pin, 0);
+    gpio_pull_up(port->pin);
+    gpio_set_dir(port->pin, GPIO_IN);
 
-    printf("USB to N64 adapter\n");
+    pio_sm_claim(pio, port->sm);
 
-    if (watchdog_caused_reboot()) {
-        TU_LOG2("Rebooted by Watchdog!\n");
-    } else {
-        TU_LOG2("Clean boot\n");
-    }
+    port->tx_dma_chan = dma_claim_unused_channel(true);
 
-    printf("clock sys = %d\n", clock_get_hz(clk_sys));
+    dma_channel_config tx_dma_chan_config = dma_channel_get_default_config(port->tx_dma_chan);
+    channel_config_set_transfer_data_size(&tx_dma_chan_config, DMA_SIZE_32);
+    channel_config_set_read_increment(&tx_dma_chan_config, true);
+    channel_config_set_write_increment(&tx_dma_chan_config, false);
+    channel_config_set_dreq(&tx_dma_chan_config, pio_get_dreq(pio, port->sm, true));
 
-    printf("Load memory pak ... ");
-    memory_pak_changed = 0;
-    memmove(memory_pak, flash_target_contents, FLASH_TARGET_SIZE);
-    printf("done\n");
+    dma_channel_configure(
+	port->tx_dma_chan,
+	&tx_dma_chan_config,
+	&pio->txf[port->sm],
+	NULL,
+	0,
+	false
+    );
+
+    pio_sm_config c = n64send_dma_program_get_default_config(tx_offset[pio_index]);
+
+    sm_config_set_in_shift(&c, false, false, 32);
+    sm_config_set_out_shift(&c, false, false, 32);
 
-    gpio_init(N64_DIO_PIN);
-    gpio_put(N64_DIO_PIN, 0);
-    gpio_pull_up(N64_DIO_PIN);
-    gpio_set_dir(N64_DIO_PIN, GPIO_IN);
+    sm_config_set_in_pins(&c, port->pin);
+    sm_config_set_out_pins(&c, port->pin, 1);
+    sm_config_set_set_pins(&c, port->pin, 1);
 
-    {
-	printf("PIO DMA enabled\n");
+    pio_gpio_init(pio, port->pin);
 
-	pio = pio0;
+    pio_sm_set_consecutive_pindirs(pio, port->sm, port->pin, 1, false);
 
-	pio_offset = pio_add_program(pio, &n64send_dma_program);
+    sm_config_set_clkdiv(&c, clkdiv);
 
-	sm = pio_claim_unused_sm(pio, true);
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
 
-	pio_dma_chan = dma_claim_unused_channel(true);
+    pio_sm_init(pio, port->sm, tx_offset[pio_index], &c);
 
-	dma_channel_config pio_dma_chan_config = dma_channel_get_default_config(pio_dma_chan);
-	channel_config_set_transfer_data_size(&pio_dma_chan_config, DMA_SIZE_32);
-	channel_config_set_read_increment(&pio_dma_chan_config, true);
-	channel_config_set_write_increment(&pio_dma_chan_config, false);
-	channel_config_set_dreq(&pio_dma_chan_config, pio_get_dreq(pio, sm, true));
+    pio_sm_set_enabled(pio, port->sm, true);
 
-	dma_channel_configure(
-	    pio_dma_chan,
-	    &pio_dma_chan_config,
-	    &pio->txf[sm],
-	    NULL,
-	    0,
-	    false
-	);
+    pio_sm_claim(pio, port->rx_sm);
 
-	pio_sm_config c = n64send_dma_program_get_default_config(pio_offset);
+    port->rx_dma_chan = dma_claim_unused_channel(true);
 
-	sm_config_set_in_shift(&c, false, false, 32);
-	sm_config_set_out_shift(&c, false, false, 32);
+    dma_channel_config rx_dma_chan_config = dma_channel_get_default_config(port->rx_dma_chan);
+    channel_config_set_transfer_data_size(&rx_dma_chan_config, DMA_SIZE_8);
+    channel_config_set_read_increment(&rx_dma_chan_config, false);
+    channel_config_set_write_increment(&rx_dma_chan_config, true);
+    channel_config_set_ring(&rx_dma_chan_config, true, 6);
+    channel_config_set_dreq(&rx_dma_chan_config, pio_get_dreq(pio, port->rx_sm, false));
 
-	sm_config_set_in_pins(&c, N64_DIO_PIN);
-	sm_config_set_out_pins(&c, N64_DIO_PIN, 1);
-	sm_config_set_set_pins(&c, N64_DIO_PIN, 1);
+    dma_channel_configure(
+	port->rx_dma_chan,
+	&rx_dma_chan_config,
+	port->rx_buffer,
+	(io_rw_8 *) &pio->rxf[port->rx_sm],
+	RX_DMA_COUNT,
+	true
+    );
 
-	pio_gpio_init(pio, N64_DIO_PIN);
+    pio_sm_config rc = n64recv_program_get_default_config(rx_offset[pio_index]);
 
-	pio_sm_set_consecutive_pindirs(pio, sm, N64_DIO_PIN, 1, false);
+    // bytes are shifted in MSB first and autopushed, so each FIFO word carries one byte in bits 7..0
+    sm_config_set_in_shift(&rc, false, true, 8);
 
-	sm_config_set_clkdiv(&c, 16.625f);
+    sm_config_set_in_pins(&rc, port->pin);
+    sm_config_set_jmp_pin(&rc, port->pin);
 
-	sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+    sm_config_set_clkdiv(&rc, clkdiv);
 
-	pio_sm_init(pio, sm, pio_offset, &c);
+    sm_config_set_fifo_join(&rc, PIO_FIFO_JOIN_RX);
 
-	pio_sm_set_enabled(pio, sm, true);
+    pio_sm_init(pio, port->rx_sm, rx_offset[pio_index] + n64recv_offset_start, &rc);
+
+    pio_sm_set_enabled(pio, port->rx_sm, true);
+}
+
+int main(void)
+{
+    set_sys_clock_khz(SYS_CLOCK_KHZ, true);
+
+    board_init();
+
+    printf("USB to N64 adapter\n");
+
+    if (watchdog_enable_caused_reboot()) {
+        TU_LOG2("Rebooted by Watchdog!\n");
+    } else {
+        TU_LOG2("Clean boot\n");
+    }
+
+    printf("clock sys = %d\n", clock_get_hz(clk_sys));
+
+    float joybus_clkdiv = (float) ((uint64_t) clock_get_hz(clk_sys) * JOYBUS_PIO_CYCLE_PS) / 1e12f;
+    printf("joybus PIO clkdiv = %.3f\n", joybus_clkdiv);
+
+    printf("PIO DMA enabled\n");
+
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	joybus_port_init(&ports[p], p, joybus_clkdiv);
+    }
+
+    stick_init();
+    button_map_init();
+    gamepad_db_init();
+
+    printf("Mount memory pak store ... ");
+    pak_store_init();
+    bool memory_pak_resumed[JOYBUS_PORTS];
+    uint32_t overlay_used[count_of(pak_overlay.free)] = { 0 };
+    bool resume = watchdog_enable_caused_reboot() && pak_store_imported() && pak_resume_header_valid();
+
+    memset(pak_overlay.clean, 0, sizeof(pak_overlay.clean));
+
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	struct joybus_port *port = &ports[p];
+
+	port->pak_slot = port->pak_slot_request = pak_store_slot(p);
+
+	memory_pak_resumed[p] = resume && pak_resume_valid(port, overlay_used);
+	if (resume) {
+	    port->use_rumble_pack = pak_resume.use_rumble_pack[p];
+	}
+	if (!memory_pak_resumed[p]) {
+	    pak_reset(port->pak);
+	}
     }
+    // entries being released when the reboot hit are free
+    for (int i = 0; i < count_of(pak_overlay.free); i++) {
+	pak_overlay.free[i] = ~overlay_used[i];
+    }
+    pak_resume.magic = 0;
 
-    core1_disable_irq = false;
+    memset(ports[0].data_block, 0x80, 32);
+    rumble_block_crc = n64_crc_data(ports[0].data_block);
+    printf("done\n");
 
     multicore_reset_core1();
     multicore_launch_core1(usb_host_process);
 
+    // the store writes flash, core1 has to be running to be locked out
+    if (!pak_store_imported()) {
+	printf("Import memory pak ... ");
+	pak_store_import(flash_target_contents);
+	printf("done\n");
+    }
+
+    // resumed blocks are saved by the main loop as usual
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	printf("Port %d: %s memory pak slot %d ... ", p + 1, memory_pak_resumed[p] ? "resume" : "load", ports[p].pak_slot);
+	pak_load(&ports[p], memory_pak_resumed[p]);
+	printf("done\n");
+    }
+    pak_resume_update();
+
     TU_LOG2("Controller enabled.\n");
 
-#ifdef USE_GPIO_IRQ
-    gpio_acknowledge_irq(N64_DIO_PIN, GPIO_IRQ_EDGE_FALL);
-    gpio_set_irq_enabled(N64_DIO_PIN, GPIO_IRQ_EDGE_FALL, true);
+#ifdef USE_JOYBUS_IRQ
+    for (int p = 0; p < JOYBUS_PORTS; p++) {
+	struct joybus_port *port = &ports[p];
+	uint irq = joybus_irq_num(p);
 
-    irq_set_exclusive_handler(IO_IRQ_BANK0, gpio_irq_handler);
-    irq_set_enabled(IO_IRQ_BANK0, true);
+	// the first port of a PIO on its IRQ 0, the second one on IRQ 1
+	pio_set_irqn_source_enabled(port->pio, p % 2, pis_interrupt0 + port->rx_sm, true);
 
-    printf("GPIO IRQ enabled\n");
+	irq_set_exclusive_handler(irq, joybus_irq_handlers[p]);
+	irq_set_enabled(irq, true);
+    }
+
+    printf("Joybus IRQ enabled\n");
 #endif
 
+    watchdog_enable(WATCHDOG_TIMEOUT_MS, true);
+
     main_loop();
 
     return 0;
@@ -0,0 +1,232 @@
+//
+// build crc benchmark
+// gcc n64_crc.c -o n64_crc -DCRC_BENCH -I. -O2 -Wall
+//
+
+#ifndef CRC_BENCH
+#include "pico.h"
+#else
+#define __not_in_flash(group)
+#define __not_in_flash_func(func_name) func_name
+#endif
+
+#include "n64_crc.h"
+
+//--------------------------------------------------------------------+
+// Controller pak data CRC
+//--------------------------------------------------------------------+
+
+// Kept in RAM, it is used between the end of a command and the reply
+const uint8_t __not_in_flash("n64_crc") n64_crc_table[256] = {
+    0x00, 0x85, 0x8F, 0x0A, 0x9B, 0x1E, 0x14, 0x91, 0xB3, 0x36, 0x3C, 0xB9, 0x28, 0xAD, 0xA7, 0x22,
+    0xE3, 0x66, 0x6C, 0xE9, 0x78, 0xFD, 0xF7, 0x72, 0x50, 0xD5, 0xDF, 0x5A, 0xCB, 0x4E, 0x44, 0xC1,
+    0x43, 0xC6, 0xCC, 0x49, 0xD8, 0x5D, 0x57, 0xD2, 0xF0, 0x75, 0x7F, 0xFA, 0x6B, 0xEE, 0xE4, 0x61,
+    0xA0, 0x25, 0x2F, 0xAA, 0x3B, 0xBE, 0xB4, 0x31, 0x13, 0x96, 0x9C, 0x19, 0x88, 0x0D, 0x07, 0x82,
+    0x86, 0x03, 0x09, 0x8C, 0x1D, 0x98, 0x92, 0x17, 0x35, 0xB0, 0xBA, 0x3F, 0xAE, 0x2B, 0x21, 0xA4,
+    0x65, 0xE0, 0xEA, 0x6F, 0xFE, 0x7B, 0x71, 0xF4, 0xD6, 0x53, 0x59, 0xDC, 0x4D, 0xC8, 0xC2, 0x47,
+    0xC5, 0x40, 0x4A, 0xCF, 0x5E, 0xDB, 0xD1, 0x54, 0x76, 0xF3, 0xF9, 0x7C, 0xED, 0x68, 0x62, 0xE7,
+    0x26, 0xA3, 0xA9, 0x2C, 0xBD, 0x38, 0x32, 0xB7, 0x95, 0x10, 0x1A, 0x9F, 0x0E, 0x8B, 0x81, 0x04,
+    0x89, 0x0C, 0x06, 0x83, 0x12, 0x97, 0x9D, 0x18, 0x3A, 0xBF, 0xB5, 0x30, 0xA1, 0x24, 0x2E, 0xAB,
+    0x6A, 0xEF, 0xE5, 0x60, 0xF1, 0x74, 0x7E, 0xFB, 0xD9, 0x5C, 0x56, 0xD3, 0x42, 0xC7, 0xCD, 0x48,
+    0xCA, 0x4F, 0x45, 0xC0, 0x51, 0xD4, 0xDE, 0x5B, 0x79, 0xFC, 0xF6, 0x73, 0xE2, 0x67, 0x6D, 0xE8,
+    0x29, 0xAC, 0xA6, 0x23, 0xB2, 0x37, 0x3D, 0xB8, 0x9A, 0x1F, 0x15, 0x90, 0x01, 0x84, 0x8E, 0x0B,
+    0x0F, 0x8A, 0x80, 0x05, 0x94, 0x11, 0x1B, 0x9E, 0xBC, 0x39, 0x33, 0xB6, 0x27, 0xA2, 0xA8, 0x2D,
+    0xEC, 0x69, 0x63, 0xE6, 0x77, 0xF2, 0xF8, 0x7D, 0x5F, 0xDA, 0xD0, 0x55, 0xC4, 0x41, 0x4B, 0xCE,
+    0x4C, 0xC9, 0xC3, 0x46, 0xD7, 0x52, 0x58, 0xDD, 0xFF, 0x7A, 0x70, 0xF5, 0x64, 0xE1, 0xEB, 0x6E,
+    0xAF, 0x2A, 0x20, 0xA5, 0x34, 0xB1, 0xBB, 0x3E, 0x1C, 0x99, 0x93, 0x16, 0x87, 0x02, 0x08, 0x8D,
+};
+
+uint8_t __not_in_flash_func(n64_crc_data)(const uint8_t *data)
+{
+    uint8_t crc = 0;
+
+    for (int i = 0; i < 32; i += 4) {
+        crc = n64_crc_table[crc ^ data[i + 0]];
+        crc = n64_crc_table[crc ^ data[i + 1]];
+        crc = n64_crc_table[crc ^ data[i + 2]];
+        crc = n64_crc_table[crc ^ data[i + 3]];
+    }
+
+    return crc;
+}
+
+//--------------------------------------------------------------------+
+// Accessory address CRC
+//--------------------------------------------------------------------+
+
+const uint8_t __not_in_flash("n64_crc") n64_addr_crc_hi[256] = {
+    0x00, 0x16, 0x19, 0x0F, 0x07, 0x11, 0x1E, 0x08, 0x0E, 0x18, 0x17, 0x01, 0x09, 0x1F, 0x10, 0x06,
+    0x1C, 0x0A, 0x05, 0x13, 0x1B, 0x0D, 0x02, 0x14, 0x12, 0x04, 0x0B, 0x1D, 0x15, 0x03, 0x0C, 0x1A,
+    0x0D, 0x1B, 0x14, 0x02, 0x0A, 0x1C, 0x13, 0x05, 0x03, 0x15, 0x1A, 0x0C, 0x04, 0x12, 0x1D, 0x0B,
+    0x11, 0x07, 0x08, 0x1E, 0x16, 0x00, 0x0F, 0x19, 0x1F, 0x09, 0x06, 0x10, 0x18, 0x0E, 0x01, 0x17,
+    0x1A, 0x0C, 0x03, 0x15, 0x1D, 0x0B, 0x04, 0x12, 0x14, 0x02, 0x0D, 0x1B, 0x13, 0x05, 0x0A, 0x1C,
+    0x06, 0x10, 0x1F, 0x09, 0x01, 0x17, 0x18, 0x0E, 0x08, 0x1E, 0x11, 0x07, 0x0F, 0x19, 0x16, 0x00,
+    0x17, 0x01, 0x0E, 0x18, 0x10, 0x06, 0x09, 0x1F, 0x19, 0x0F, 0x00, 0x16, 0x1E, 0x08, 0x07, 0x11,
+    0x0B, 0x1D, 0x12, 0x04, 0x0C, 0x1A, 0x15, 0x03, 0x05, 0x13, 0x1C, 0x0A, 0x02, 0x14, 0x1B, 0x0D,
+    0x01, 0x17, 0x18, 0x0E, 0x06, 0x10, 0x1F, 0x09, 0x0F, 0x19, 0x16, 0x00, 0x08, 0x1E, 0x11, 0x07,
+    0x1D, 0x0B, 0x04, 0x12, 0x1A, 0x0C, 0x03, 0x15, 0x13, 0x05, 0x0A, 0x1C, 0x14, 0x02, 0x0D, 0x1B,
+    0x0C, 0x1A, 0x15, 0x03, 0x0B, 0x1D, 0x12, 0x04, 0x02, 0x14, 0x1B, 0x0D, 0x05, 0x13, 0x1C, 0x0A,
+    0x10, 0x06, 0x09, 0x1F, 0x17, 0x01, 0x0E, 0x18, 0x1E, 0x08, 0x07, 0x11, 0x19, 0x0F, 0x00, 0x16,
+    0x1B, 0x0D, 0x02, 0x14, 0x1C, 0x0A, 0x05, 0x13, 0x15, 0x03, 0x0C, 0x1A, 0x12, 0x04, 0x0B, 0x1D,
+    0x07, 0x11, 0x1E, 0x08, 0x00, 0x16, 0x19, 0x0F, 0x09, 0x1F, 0x10, 0x06, 0x0E, 0x18, 0x17, 0x01,
+    0x16, 0x00, 0x0F, 0x19, 0x11, 0x07, 0x08, 0x1E, 0x18, 0x0E, 0x01, 0x17, 0x1F, 0x09, 0x06, 0x10,
+    0x0A, 0x1C, 0x13, 0x05, 0x0D, 0x1B, 0x14, 0x02, 0x04, 0x12, 0x1D, 0x0B, 0x03, 0x15, 0x1A, 0x0C,
+};
+
+const uint8_t __not_in_flash("n64_crc") n64_addr_crc_lo[8] = {
+    0x00, 0x15, 0x1F, 0x0A, 0x0B, 0x1E, 0x14, 0x01,
+};
+
+#ifdef CRC_BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_BLOCKS	1024
+#define BENCH_ROUNDS	2000
+
+// the bit serial implementation the table replaces
+static uint8_t calc_data_crc(const uint8_t *data)
+{
+    uint8_t ret = 0;
+
+    for(int i = 0; i <= 32; i++) {
+        for(int j = 7; j >= 0; j--) {
+            int tmp = 0;
+
+            if(ret & 0x80) {
+                tmp = 0x85;
+            }
+
+            ret <<= 1;
+
+            if(i < 32) {
+                if(data[i] & (0x01 << j)) {
+                    ret |= 0x1;
+                }
+            }
+            ret ^= tmp;
+        }
+    }
+
+    return ret;
+}
+
+// the bit loop the address tables replace
+static uint16_t calc_address_crc(uint16_t address)
+{
+    /* CRC table */
+    uint16_t xor_table[16] = { 0x0, 0x0, 0x0, 0x0, 0x0, 0x15, 0x1F, 0x0B, 0x16, 0x19, 0x07, 0x0E, 0x1C, 0x0D, 0x1A, 0x01 };
+    uint16_t crc = 0;
+
+    /* Make sure we have a valid address */
+    address &= ~0x1F;
+
+    /* Go through each bit in the address, and if set, xor the right value into the output */
+    for(int i = 15; i >= 5; i--) {
+        /* Is this bit set? */
+        if(((address >> i) & 0x1)) {
+            crc ^= xor_table[i];
+        }
+    }
+
+    /* Just in case */
+    crc &= 0x1F;
+
+    /* Create a new address with the CRC appended */
+    return address | crc;
+}
+
+static uint8_t pak[BENCH_BLOCKS * 32];
+
+static double bench(uint8_t (*crc_func)(const uint8_t *), volatile uint8_t *sink)
+{
+    clock_t start = clock();
+
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (int b = 0; b < BENCH_BLOCKS; b++) {
+            *sink ^= crc_func(&pak[b * 32]);
+        }
+    }
+
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static uint8_t incremental_crc(const uint8_t *data)
+{
+    uint8_t crc = 0;
+
+    for (int i = 0; i < 32; i++) {
+        crc = n64_crc_update(crc, data[i]);
+    }
+
+    return crc;
+}
+
+int main(int argc, char *argv[])
+{
+    volatile uint8_t sink = 0;
+
+    srand(1);
+    for (int i = 0; i < sizeof(pak); i++) {
+        pak[i] = rand();
+    }
+    // a formatted pak is mostly filler
+    for (int i = 0; i < 32; i++) {
+        pak[i] = 0x00;
+        pak[32 + i] = 0x03;
+    }
+
+    for (int b = 0; b < BENCH_BLOCKS; b++) {
+        uint8_t ref = calc_data_crc(&pak[b * 32]);
+
+        if (n64_crc_data(&pak[b * 32]) != ref || incremental_crc(&pak[b * 32]) != ref) {
+            printf("CRC mismatch in block %d\n", b);
+            return 1;
+        }
+    }
+    printf("%d blocks verified\n", BENCH_BLOCKS);
+
+    for (uint32_t a = 0; a < 0x10000; a++) {
+        uint16_t ref = calc_address_crc(a);
+
+        if (n64_crc_address(a) != ref || n64_crc_address_valid(a) != (ref == a)) {
+            printf("address CRC mismatch at %04X\n", a);
+            return 1;
+        }
+    }
+    printf("%d addresses verified\n", 0x10000);
+
+    double t_bit = bench(calc_data_crc, &sink);
+    double t_table = bench(n64_crc_data, &sink);
+    double t_inc = bench(incremental_crc, &sink);
+    double n = (double) BENCH_BLOCKS * BENCH_ROUNDS;
+
+    printf("bit serial  %8.1f ns/block\n", t_bit * 1e9 / n);
+    printf("table       %8.1f ns/block (%.1fx)\n", t_table * 1e9 / n, t_bit / t_table);
+    printf("incremental %8.1f ns/block (%.1fx)\n", t_inc * 1e9 / n, t_bit / t_inc);
+
+    clock_t start = clock();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (uint32_t a = 0; a < 0x10000; a += 32) {
+            sink ^= calc_address_crc(a + r);
+        }
+    }
+    double t_addr_bit = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (uint32_t a = 0; a < 0x10000; a += 32) {
+            sink ^= n64_crc_address(a + r);
+        }
+    }
+    double t_addr_table = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    n = (double) BENCH_ROUNDS * 2048;
+    printf("address bit loop %8.1f ns\n", t_addr_bit * 1e9 / n);
+    printf("address table    %8.1f ns (%.1fx)\n", t_addr_table * 1e9 / n, t_addr_bit / t_addr_table);
+
+    return 0;
+}
+#endif
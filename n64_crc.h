@@ -0,0 +1,36 @@
+#ifndef _N64_CRC_H_
+#define _N64_CRC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// CRC-8, polynomial x^8 + x^7 + x^2 + 1 (0x85), MSB first, initial value 0
+extern const uint8_t n64_crc_table[256];
+
+static inline uint8_t n64_crc_update(uint8_t crc, uint8_t byte)
+{
+    return n64_crc_table[crc ^ byte];
+}
+
+// CRC of a 32 byte controller pak block
+uint8_t n64_crc_data(const uint8_t *data);
+
+// 5 bit CRC of the 11 bit block address (bits 15..5) of an accessory
+// address. The CRC is linear, so it is the XOR of the CRCs of bits 15..8
+// and bits 7..5.
+extern const uint8_t n64_addr_crc_hi[256];
+extern const uint8_t n64_addr_crc_lo[8];
+
+static inline uint16_t n64_crc_address(uint16_t address)
+{
+    address &= ~0x1F;
+
+    return address | (n64_addr_crc_hi[address >> 8] ^ n64_addr_crc_lo[(address >> 5) & 0x07]);
+}
+
+static inline bool n64_crc_address_valid(uint16_t address)
+{
+    return n64_crc_address(address) == address;
+}
+
+#endif
@@ -0,0 +1,769 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/flash.h"
+#include "hardware/flash.h"
+
+#include "pak_store.h"
+
+#define PAK_STORE_SECTORS	(PAK_STORE_SIZE / FLASH_SECTOR_SIZE)
+
+// move the live records out of the oldest sector once fewer sectors are free
+#define PAK_STORE_COMPACT_FREE	4
+
+// Free sectors kept erased after the head sector, so appends during play
+// take page programs only. 48 KB hold a whole pak of incompressible blocks.
+#define PAK_STORE_ERASE_AHEAD	12
+
+#define PAK_STORE_MAGIC		0x4B50344E
+
+// key = slot << 10 | block, one more key holds the slot of every port and
+// another one is written once the old pak image is imported
+#define PAK_STORE_CONFIG_KEY	(PAK_STORE_SLOTS * PAK_STORE_BLOCKS)
+#define PAK_STORE_IMPORT_KEY	(PAK_STORE_CONFIG_KEY + 1)
+#define PAK_STORE_KEYS		(PAK_STORE_IMPORT_KEY + 1)
+
+// first bytes of every sector in use, seq grows by one per opened sector
+struct pak_store_sector {
+    uint32_t magic;
+    uint32_t seq;
+};
+
+// Records are 4 byte aligned and never cross a flash page. An unwritten key
+// (0xFFFF) pads the rest of a page, or ends the sector at a page start.
+// A block payload shorter than 32 bytes is RLE packed. seq counts modulo
+// 2^24, far more than the records the region can hold.
+struct pak_store_record {
+    uint16_t key;
+    uint16_t crc;
+    uint32_t len : 8;
+    uint32_t seq : 24;
+    uint8_t  data[];
+};
+
+// smallest record: a block of 32 equal bytes
+#define RECORD_MIN_SIZE		12
+
+static const uint8_t *store = (const uint8_t *) (XIP_BASE + PAK_STORE_OFFSET);
+
+// offset of the latest record of every block of the slot of a port, 0 if none
+static uint32_t store_index[PAK_STORE_PORTS][PAK_STORE_BLOCKS];
+static uint8_t store_slot[PAK_STORE_PORTS];
+static uint32_t config_off;
+static bool imported;
+
+static uint32_t record_seq;
+static bool record_seq_found;
+static uint32_t sector_seq;
+
+// sectors in use, from the oldest one (tail) to the one being appended
+static uint32_t tail;
+static uint32_t used;
+
+// next free byte, RAM image of the flash page holding it
+static uint32_t head;
+static uint32_t page_addr;
+static uint8_t page[FLASH_PAGE_SIZE] __attribute__((aligned (4)));
+static bool page_dirty;
+// page_addr starts a new sector that has to be erased first
+static bool head_erase;
+// free sectors after the one of page_addr that are erased already
+static uint32_t erased_ahead;
+
+// Compaction of the tail sector: keys written after its live records, and
+// the sector offsets of those records (0 = superseded)
+static uint32_t compact_seen[(PAK_STORE_KEYS + 31) / 32];
+static uint16_t compact_list[FLASH_SECTOR_SIZE / RECORD_MIN_SIZE];
+static uint32_t compact_count;
+static uint32_t compact_next;
+static bool compact_scanned;
+
+static inline uint32_t record_size(uint8_t len)
+{
+    return (sizeof(struct pak_store_record) + len + 3) & ~3;
+}
+
+// CRC-16/CCITT, a torn record must not pass by chance
+static const uint16_t crc16_nibble[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+static uint16_t record_crc(const struct pak_store_record *rec)
+{
+    const uint8_t *p = (const uint8_t *) rec;
+    uint16_t crc = 0xFFFF;
+
+    for (uint32_t i = 0; i < sizeof(*rec) + rec->len; i++) {
+	if (i == offsetof(struct pak_store_record, crc)) {
+	    i += sizeof(rec->crc) - 1;
+	    continue;
+	}
+	crc = (crc << 4) ^ crc16_nibble[(crc >> 12) ^ (p[i] >> 4)];
+	crc = (crc << 4) ^ crc16_nibble[(crc >> 12) ^ (p[i] & 0x0F)];
+    }
+
+    return crc;
+}
+
+static inline bool seq_after(uint32_t a, uint32_t b)
+{
+    return ((a - b) & 0xFFFFFF) - 1 < 0x7FFFFF;
+}
+
+static const struct pak_store_record *__not_in_flash_func(record_at)(uint32_t off)
+{
+    // the page being filled may not be programmed yet
+    if ((off & ~(FLASH_PAGE_SIZE - 1)) == page_addr) {
+	return (const struct pak_store_record *) &page[off - page_addr];
+    }
+
+    return (const struct pak_store_record *) &store[off];
+}
+
+static inline bool newer(const struct pak_store_record *rec, uint32_t off)
+{
+    return off == 0 || seq_after(rec->seq, record_at(off)->seq);
+}
+
+//--------------------------------------------------------------------+
+// RLE: a control byte c < 0x80 is followed by c + 1 literal bytes,
+// c >= 0x80 by one byte repeated (c & 0x7F) + 1 times
+//--------------------------------------------------------------------+
+
+// Packed length, 32 if packing does not save anything
+static uint8_t rle_encode(const uint8_t *data, uint8_t *out)
+{
+    int n = 0;
+    int lit = -1;
+
+    for (int i = 0; i < 32; ) {
+	int run = 1;
+
+	while (i + run < 32 && data[i + run] == data[i]) {
+	    run++;
+	}
+
+	if (run >= 3) {
+	    if (n + 2 >= 32) {
+		return 32;
+	    }
+	    out[n++] = 0x80 | (run - 1);
+	    out[n++] = data[i];
+	    lit = -1;
+	    i += run;
+	} else {
+	    if (lit < 0) {
+		if (n + 2 >= 32) {
+		    return 32;
+		}
+		lit = n++;
+		out[lit] = 0;
+	    } else {
+		if (n + 1 >= 32) {
+		    return 32;
+		}
+		out[lit]++;
+	    }
+	    out[n++] = data[i++];
+	}
+    }
+
+    return n;
+}
+
+static void __not_in_flash_func(rle_decode)(const uint8_t *in, uint8_t len, uint8_t *data)
+{
+    int n = 0;
+
+    for (int i = 0; i < len && n < 32; ) {
+	uint8_t c = in[i++];
+	int count = MIN((c & 0x7F) + 1, 32 - n);
+
+	if (c & 0x80) {
+	    memset(&data[n], in[i++], count);
+	} else {
+	    memcpy(&data[n], &in[i], count);
+	    i += count;
+	}
+	n += count;
+    }
+}
+
+//--------------------------------------------------------------------+
+// Log
+//--------------------------------------------------------------------+
+
+static bool sector_valid(uint32_t sector)
+{
+    return ((const struct pak_store_sector *) &store[sector * FLASH_SECTOR_SIZE])->magic == PAK_STORE_MAGIC;
+}
+
+static uint32_t sector_seq_of(uint32_t sector)
+{
+    return ((const struct pak_store_sector *) &store[sector * FLASH_SECTOR_SIZE])->seq;
+}
+
+static bool sector_blank(uint32_t sector)
+{
+    const uint32_t *p = (const uint32_t *) &store[sector * FLASH_SECTOR_SIZE];
+
+    for (uint32_t i = 0; i < FLASH_SECTOR_SIZE / 4; i++) {
+	if (p[i] != 0xFFFFFFFF) {
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+static inline uint32_t erase_ahead_target(void)
+{
+    return MIN(PAK_STORE_ERASE_AHEAD, PAK_STORE_SECTORS - used);
+}
+
+// Offset of the first intact record in [off, end), 0 if there is none
+static uint32_t find_record(uint32_t off, uint32_t end)
+{
+    while (off < end) {
+	uint32_t page_end = (off | (FLASH_PAGE_SIZE - 1)) + 1;
+	const struct pak_store_record *rec = record_at(off);
+
+	if (page_end - off < sizeof(*rec)) {
+	    off = page_end;
+	} else if (rec->key == 0xFFFF) {
+	    if (!(off & (FLASH_PAGE_SIZE - 1))) {
+		break;
+	    }
+	    off = page_end;
+	} else if (rec->key < PAK_STORE_KEYS && rec->len > 0 && rec->len <= 32 &&
+		   off + record_size(rec->len) <= page_end && rec->crc == record_crc(rec)) {
+	    return off;
+	} else {
+	    // torn by a power loss, appends went on with the next page
+	    off = page_end;
+	}
+    }
+
+    return 0;
+}
+
+// Call fn for every intact record of count sectors from first on, in log order
+static void scan_records(uint32_t first, uint32_t count, void (*fn)(uint32_t off))
+{
+    for (uint32_t i = 0; i < count; i++) {
+	uint32_t base = ((first + i) % PAK_STORE_SECTORS) * FLASH_SECTOR_SIZE;
+	uint32_t end = base + FLASH_SECTOR_SIZE;
+
+	for (uint32_t off = find_record(base + sizeof(struct pak_store_sector), end); off;
+	     off = find_record(off + record_size(record_at(off)->len), end)) {
+	    fn(off);
+	}
+    }
+}
+
+// The record of a key with the highest seq wins
+static void index_port_record(uint8_t port, uint32_t off)
+{
+    const struct pak_store_record *rec = record_at(off);
+
+    if (rec->key / PAK_STORE_BLOCKS == store_slot[port]) {
+	uint32_t *entry = &store_index[port][rec->key % PAK_STORE_BLOCKS];
+
+	if (newer(rec, *entry)) {
+	    *entry = off;
+	}
+    }
+}
+
+static void index_record(uint32_t off)
+{
+    const struct pak_store_record *rec = record_at(off);
+
+    if (rec->key == PAK_STORE_CONFIG_KEY) {
+	if (newer(rec, config_off)) {
+	    config_off = off;
+	}
+	return;
+    }
+
+    if (rec->key == PAK_STORE_IMPORT_KEY) {
+	imported = true;
+	return;
+    }
+
+    for (int port = 0; port < PAK_STORE_PORTS; port++) {
+	index_port_record(port, off);
+    }
+}
+
+static void mount_record(uint32_t off)
+{
+    const struct pak_store_record *rec = record_at(off);
+
+    if (!record_seq_found || !seq_after(record_seq, rec->seq)) {
+	record_seq = rec->seq + 1;
+	record_seq_found = true;
+    }
+
+    if (rec->key == PAK_STORE_CONFIG_KEY && newer(rec, config_off)) {
+	config_off = off;
+    }
+}
+
+static uint8_t build_port;
+
+static void build_index_record(uint32_t off)
+{
+    index_port_record(build_port, off);
+}
+
+// The other ports keep their index, the IRQ may be reading it
+static void build_index(uint8_t port)
+{
+    memset(store_index[port], 0, sizeof(store_index[port]));
+    build_port = port;
+    scan_records(tail, used, build_index_record);
+}
+
+// Slots from the config record, older firmware saved only the first port's.
+// Ports without a slot of their own get the first one nobody uses.
+static void load_config(void)
+{
+    const struct pak_store_record *rec = config_off ? record_at(config_off) : NULL;
+    uint32_t taken = 0;
+
+    for (int port = 0; port < PAK_STORE_PORTS; port++) {
+	uint8_t slot = PAK_STORE_SLOTS;
+
+	if (rec && port < rec->len && rec->data[port] < PAK_STORE_SLOTS &&
+	    !(taken & (1u << rec->data[port]))) {
+	    slot = rec->data[port];
+	} else {
+	    for (slot = 0; taken & (1u << slot); slot++) {
+	    }
+	}
+
+	store_slot[port] = slot;
+	taken |= 1u << slot;
+    }
+}
+
+bool pak_store_init(void)
+{
+    uint32_t newest = 0;
+    bool found = false;
+
+    record_seq = 0;
+    record_seq_found = false;
+    config_off = 0;
+    imported = false;
+    page_addr = PAK_STORE_SIZE;
+    page_dirty = false;
+    head_erase = false;
+    erased_ahead = 0;
+    compact_scanned = false;
+    memset(store_index, 0, sizeof(store_index));
+
+    for (uint32_t s = 0; s < PAK_STORE_SECTORS; s++) {
+	if (sector_valid(s) && (!found || (int32_t)(sector_seq_of(s) - sector_seq_of(newest)) > 0)) {
+	    newest = s;
+	    found = true;
+	}
+    }
+
+    if (!found) {
+	load_config();
+	tail = 0;
+	used = 1;
+	sector_seq = 0;
+	head = 0;
+	page_addr = 0;
+	head_erase = true;
+	return false;
+    }
+
+    // the log runs back from the newest sector through consecutive sequence numbers
+    tail = newest;
+    used = 1;
+    while (used < PAK_STORE_SECTORS) {
+	uint32_t prev = (tail + PAK_STORE_SECTORS - 1) % PAK_STORE_SECTORS;
+
+	if (!sector_valid(prev) || sector_seq_of(prev) != sector_seq_of(tail) - 1) {
+	    break;
+	}
+	tail = prev;
+	used++;
+    }
+    sector_seq = sector_seq_of(newest) + 1;
+
+    scan_records(tail, used, mount_record);
+    load_config();
+    // store_index is clear, one pass indexes every port
+    scan_records(tail, used, index_record);
+
+    // appends go on at the first unwritten page of the newest sector
+    uint32_t base = newest * FLASH_SECTOR_SIZE;
+
+    head = base + FLASH_SECTOR_SIZE;
+    for (uint32_t p = FLASH_PAGE_SIZE; p < FLASH_SECTOR_SIZE; p += FLASH_PAGE_SIZE) {
+	if (record_at(base + p)->key == 0xFFFF) {
+	    head = base + p;
+	    break;
+	}
+    }
+
+    // a full sector keeps its last page, the next append opens a new sector
+    page_addr = (head - 1) & ~(FLASH_PAGE_SIZE - 1);
+    if (head & (FLASH_SECTOR_SIZE - 1)) {
+	page_addr = head;
+    }
+    memcpy(page, &store[page_addr], FLASH_PAGE_SIZE);
+
+    // sectors erased ahead before the reboot need no erase again
+    while (erased_ahead < erase_ahead_target() &&
+	   sector_blank((newest + 1 + erased_ahead) % PAK_STORE_SECTORS)) {
+	erased_ahead++;
+    }
+
+    return true;
+}
+
+// Start the erased sector at page_addr with its header
+static void open_sector(void)
+{
+    struct pak_store_sector *sector = (struct pak_store_sector *) page;
+
+    memset(page, 0xFF, sizeof(page));
+    sector->magic = PAK_STORE_MAGIC;
+    sector->seq = sector_seq++;
+    head = page_addr + sizeof(*sector);
+    page_dirty = true;
+}
+
+// Copy a record to the page buffer, false if a flash operation has to run
+// first. Opening a sector must leave more than reserve sectors free.
+static bool stage_record(uint16_t key, const uint8_t *data, uint8_t len, uint32_t reserve)
+{
+    uint32_t size = record_size(len);
+
+    if (head_erase) {
+	return false;
+    }
+
+    if (page_addr + FLASH_PAGE_SIZE - head < size) {
+	uint32_t next = page_addr + FLASH_PAGE_SIZE;
+
+	if (page_dirty) {
+	    return false;
+	}
+
+	bool new_sector = !(next & (FLASH_SECTOR_SIZE - 1));
+
+	if (new_sector) {
+	    if (PAK_STORE_SECTORS - used <= reserve) {
+		return false;
+	    }
+	    next %= PAK_STORE_SIZE;
+	    used++;
+	    if (erased_ahead) {
+		erased_ahead--;
+	    } else {
+		head_erase = true;
+	    }
+	}
+
+	page_addr = next;
+	head = next;
+	// pak_store_read() from the IRQ must see the old page in flash from now on
+	__compiler_memory_barrier();
+
+	if (head_erase) {
+	    return false;
+	}
+	if (new_sector) {
+	    open_sector();
+	} else {
+	    memset(page, 0xFF, sizeof(page));
+	}
+    }
+
+    struct pak_store_record *rec = (struct pak_store_record *) &page[head - page_addr];
+
+    rec->key = key;
+    rec->len = len;
+    rec->seq = record_seq++;
+    memcpy(rec->data, data, len);
+    rec->crc = record_crc(rec);
+    __compiler_memory_barrier();
+
+    index_record(head);
+    // a copy of the tail sector that is not live anymore
+    compact_seen[key / 32] |= 1u << (key % 32);
+
+    head += size;
+    page_dirty = true;
+
+    return true;
+}
+
+// New data, keep a sector free for compaction to make progress
+static bool append_record(uint16_t key, const uint8_t *data, uint8_t len)
+{
+    return stage_record(key, data, len, 1);
+}
+
+uint8_t pak_store_slot(uint8_t port)
+{
+    return store_slot[port];
+}
+
+bool pak_store_select(uint8_t port, uint8_t slot)
+{
+    uint8_t slots[PAK_STORE_PORTS];
+
+    if (slot == store_slot[port]) {
+	return true;
+    }
+
+    memcpy(slots, store_slot, sizeof(slots));
+    slots[port] = slot;
+
+    if (!append_record(PAK_STORE_CONFIG_KEY, slots, sizeof(slots))) {
+	return false;
+    }
+
+    store_slot[port] = slot;
+    build_index(port);
+
+    return true;
+}
+
+// In RAM, the joybus IRQ serves pak reads with it
+void __not_in_flash_func(pak_store_read)(uint8_t port, uint16_t block, uint8_t *data)
+{
+    uint32_t off = store_index[port][block];
+
+    if (!off) {
+	memset(data, 0x00, 32);
+	return;
+    }
+
+    const struct pak_store_record *rec = record_at(off);
+
+    if (rec->len == 32) {
+	memcpy(data, rec->data, 32);
+    } else {
+	rle_decode(rec->data, rec->len, data);
+    }
+}
+
+static bool append_block(uint16_t key, const uint8_t *data)
+{
+    uint8_t packed[32];
+    uint8_t len = rle_encode(data, packed);
+
+    return append_record(key, len < 32 ? packed : data, len);
+}
+
+bool pak_store_write(uint8_t port, uint16_t block, const uint8_t *data)
+{
+    uint8_t saved[32];
+
+    pak_store_read(port, block, saved);
+    if (!memcmp(saved, data, 32)) {
+	return true;
+    }
+
+    return append_block(store_slot[port] * PAK_STORE_BLOCKS + block, data);
+}
+
+//--------------------------------------------------------------------+
+// Import
+//--------------------------------------------------------------------+
+
+// blocks of slot 0 with a record, while importing
+static uint32_t import_saved[PAK_STORE_BLOCKS / 32];
+
+static void import_mark_saved(uint32_t off)
+{
+    uint16_t key = record_at(off)->key;
+
+    if (key < PAK_STORE_BLOCKS) {
+	import_saved[key / 32] |= 1u << (key % 32);
+    }
+}
+
+bool pak_store_imported(void)
+{
+    return imported;
+}
+
+void pak_store_import(const uint8_t *image)
+{
+    static const uint8_t zero_block[32];
+    const uint8_t done = 1;
+
+    // an empty store has no sector to scan yet
+    memset(import_saved, 0, sizeof(import_saved));
+    if (sector_valid(tail)) {
+	scan_records(tail, used, import_mark_saved);
+    }
+
+    // a block with a record was imported before a power loss, or saved since
+    for (int i = 0; i < PAK_STORE_BLOCKS; i++) {
+	const uint8_t *data = image + i * 32;
+
+	if ((import_saved[i / 32] & (1u << (i % 32))) || !memcmp(data, zero_block, 32)) {
+	    continue;
+	}
+
+	while (!append_block(i, data)) {
+	    pak_store_step(true);
+	}
+    }
+
+    while (!append_record(PAK_STORE_IMPORT_KEY, &done, sizeof(done))) {
+	pak_store_step(true);
+    }
+
+    while (pak_store_busy()) {
+	pak_store_step(true);
+    }
+}
+
+//--------------------------------------------------------------------+
+// Compaction
+//--------------------------------------------------------------------+
+
+// the sectors erased ahead count as free, compaction keeps room for them
+static bool compacting(void)
+{
+    return PAK_STORE_SECTORS - used < PAK_STORE_COMPACT_FREE + PAK_STORE_ERASE_AHEAD;
+}
+
+bool pak_store_busy(void)
+{
+    return head_erase || page_dirty || compacting() || erased_ahead < erase_ahead_target();
+}
+
+// records are only queued in the page buffer, the next page is started once
+// it is programmed
+bool pak_store_pending(void)
+{
+    return page_dirty;
+}
+
+static void compact_mark_seen(uint32_t off)
+{
+    uint16_t key = record_at(off)->key;
+
+    compact_seen[key / 32] |= 1u << (key % 32);
+}
+
+static void compact_add(uint32_t off)
+{
+    compact_list[compact_count++] = off % FLASH_SECTOR_SIZE;
+}
+
+// One pass over the newer sectors tells which records of the tail are live
+static void compact_scan(void)
+{
+    memset(compact_seen, 0, sizeof(compact_seen));
+    scan_records(tail + 1, used - 1, compact_mark_seen);
+
+    compact_count = 0;
+    scan_records(tail, 1, compact_add);
+
+    // the last record of a key in the tail sector is the live one
+    for (uint32_t i = compact_count; i-- > 0; ) {
+	uint16_t key = record_at(tail * FLASH_SECTOR_SIZE + compact_list[i])->key;
+
+	if (compact_seen[key / 32] & (1u << (key % 32))) {
+	    compact_list[i] = 0;
+	} else {
+	    compact_seen[key / 32] |= 1u << (key % 32);
+	}
+    }
+
+    // from now on a set bit means the key was written again
+    for (uint32_t i = 0; i < compact_count; i++) {
+	if (compact_list[i]) {
+	    uint16_t key = record_at(tail * FLASH_SECTOR_SIZE + compact_list[i])->key;
+
+	    compact_seen[key / 32] &= ~(1u << (key % 32));
+	}
+    }
+
+    compact_next = 0;
+    compact_scanned = true;
+}
+
+// Append the live records of the tail sector again, as many as fit
+static void compact_stage(void)
+{
+    if (!compact_scanned) {
+	compact_scan();
+    }
+
+    for (; compact_next < compact_count; compact_next++) {
+	const struct pak_store_record *rec;
+
+	if (!compact_list[compact_next]) {
+	    continue;
+	}
+
+	rec = record_at(tail * FLASH_SECTOR_SIZE + compact_list[compact_next]);
+	if (compact_seen[rec->key / 32] & (1u << (rec->key % 32))) {
+	    continue;
+	}
+	if (!stage_record(rec->key, rec->data, rec->len, 0)) {
+	    break;
+	}
+    }
+}
+
+static void __not_in_flash_func(store_erase)(void *param)
+{
+    flash_range_erase(PAK_STORE_OFFSET + (uint32_t) param, FLASH_SECTOR_SIZE);
+}
+
+static void __not_in_flash_func(store_program)(void *param)
+{
+    flash_range_program(PAK_STORE_OFFSET + page_addr, page, FLASH_PAGE_SIZE);
+}
+
+void pak_store_step(bool idle)
+{
+    // copies would use up the sectors erased for the game's saves
+    if (idle && compacting()) {
+	compact_stage();
+    }
+
+    if (head_erase) {
+	if (idle && flash_safe_execute(store_erase, (void *) page_addr, 100) == PICO_OK) {
+	    open_sector();
+	    head_erase = false;
+	}
+    } else if (page_dirty) {
+	if (flash_safe_execute(store_program, NULL, 100) == PICO_OK) {
+	    page_dirty = false;
+	}
+    } else if (!idle) {
+	return;
+    } else if (compacting() && compact_next == compact_count) {
+	// every live record of the tail sector is in a newer sector now
+	if (flash_safe_execute(store_erase, (void *) (tail * FLASH_SECTOR_SIZE), 100) == PICO_OK) {
+	    tail = (tail + 1) % PAK_STORE_SECTORS;
+	    used--;
+	    compact_scanned = false;
+	}
+    } else if (erased_ahead < erase_ahead_target()) {
+	uint32_t sector = (page_addr / FLASH_SECTOR_SIZE + 1 + erased_ahead) % PAK_STORE_SECTORS;
+
+	if (flash_safe_execute(store_erase, (void *) (sector * FLASH_SECTOR_SIZE), 100) == PICO_OK) {
+	    erased_ahead++;
+	}
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef _PAK_STORE_H_
+#define _PAK_STORE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Memory pak blocks are kept as an append-only log of records in a flash
+// region much larger than the pak, so a save is a page program instead of a
+// sector erase and a power loss can only lose the record being written.
+// The region holds PAK_STORE_SLOTS independent paks, blocks are RLE packed.
+// Each of PAK_STORE_PORTS controller ports has its own slot in use, two
+// ports must not use the same slot.
+
+// 8 slots of incompressible blocks take about 345 KB of records
+#define PAK_STORE_SIZE		(512 * 1024)
+// just below the old fixed 32 KB pak image at the end of the 2 MB flash
+#define PAK_STORE_OFFSET	(2 * 1024 * 1024 - 32 * 1024 - PAK_STORE_SIZE)
+
+#define PAK_STORE_BLOCKS	(32768 / 32)
+#define PAK_STORE_SLOTS		8
+#define PAK_STORE_PORTS		4
+
+// Mount the store and rebuild the block index, false if it holds no data yet
+bool pak_store_init(void);
+
+// Slot in use on a port, restored by pak_store_init()
+uint8_t pak_store_slot(uint8_t port);
+
+// Switch a port to another slot and remember it, false if there is no room
+// until pak_store_step() has run
+bool pak_store_select(uint8_t port, uint8_t slot);
+
+// Latest saved copy of a block of the slot in use, zeros if it was never saved.
+// Safe from an IRQ that preempts the other calls, but not during a flash operation.
+void pak_store_read(uint8_t port, uint16_t block, uint8_t *data);
+
+// Queue a block for saving, false if there is no room until pak_store_step()
+// has run. A block equal to its saved copy is not written again. It is in
+// flash once pak_store_pending() is false.
+bool pak_store_write(uint8_t port, uint16_t block, const uint8_t *data);
+
+// The old pak image was imported completely
+bool pak_store_imported(void);
+
+// Import a 32 KB pak image into slot 0, the blocks it has no record of yet.
+// Runs the flash operations itself, erases included and writes the import record last, so an
+// import cut short by a power loss goes on at the next boot.
+void pak_store_import(const uint8_t *image);
+
+// Queued records, compaction or sectors to erase ahead need flash operations
+bool pak_store_busy(void);
+
+// Records queued by pak_store_write() or pak_store_select() are not
+// programmed yet, a reboot now would lose them
+bool pak_store_pending(void);
+
+// Run one flash operation through flash_safe_execute(). A page program is
+// over in about a millisecond, a sector erase takes tens of milliseconds and
+// only runs when idle. Free sectors are erased ahead while idle, so saving
+// during play takes page programs only.
+void pak_store_step(bool idle);
+
+#endif
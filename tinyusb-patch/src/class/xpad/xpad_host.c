@@ -33,13 +33,6 @@
 
 #include "xpad_host.h"
 
-static uint8_t serial = 0;
-
-static xpad_ctype_t xpad_ctype = XPAD_UNKNOWN;
-
-CFG_TUSB_MEM_SECTION static uint8_t odata[32];
-CFG_TUSB_MEM_SECTION static uint8_t idata[32];
-
 //--------------------------------------------------------------------+
 // MACRO CONSTANT TYPEDEF
 //--------------------------------------------------------------------+
@@ -51,12 +44,19 @@ typedef struct {
 
   uint8_t ep_in[5];
   uint8_t ep_out[5];
+
+  xpad_ctype_t ctype;
+  uint8_t serial;
+  xpad_controller_t old_info;
+
+  CFG_TUSB_MEM_ALIGN uint8_t odata[32];
+  CFG_TUSB_MEM_ALIGN uint8_t idata[32];
 } xpadh_data_t;
 
 //--------------------------------------------------------------------+
 // INTERNAL OBJECT & FUNCTION DECLARATION
 //--------------------------------------------------------------------+
-static xpadh_data_t xpadh_data[CFG_TUH_DEVICE_MAX];
+CFG_TUSB_MEM_SECTION static xpadh_data_t xpadh_data[CFG_TUH_DEVICE_MAX];
 
 static inline xpadh_data_t* get_itf(uint8_t dev_addr)
 {
@@ -111,20 +111,20 @@ bool xpadh_open(uint8_t rhport, uint8_t dev_addr, tusb_desc_interface_t const *i
 
   TU_LOG2("class = %02X subclass = %02X protocol = %02X\n", itf_desc->bInterfaceClass, itf_desc->bInterfaceSubClass, itf_desc->bInterfaceProtocol);
 
+  xpadh_data_t * p_xpad = get_itf(dev_addr);
+
   if (itf_desc->bInterfaceClass    == TUSB_CLASS_VENDOR_SPECIFIC &&
             itf_desc->bInterfaceSubClass == 0x47 &&
             itf_desc->bInterfaceProtocol == 0xd0) {
-    xpad_ctype = XPAD_XBONE;
+    p_xpad->ctype = XPAD_XBONE;
   } else if (itf_desc->bInterfaceClass    == TUSB_CLASS_VENDOR_SPECIFIC &&
             itf_desc->bInterfaceSubClass == 0x5d &&
             itf_desc->bInterfaceProtocol == 0x01) {
-    xpad_ctype = XPAD_360_WIRED;
+    p_xpad->ctype = XPAD_360_WIRED;
   } else {
     return false;
   }
 
-  xpadh_data_t * p_xpad = get_itf(dev_addr);
-
   uint8_t itf_count = p_xpad->itf_count++;
 
   if (itf_count > 0) {
@@ -170,18 +170,21 @@ bool xpadh_open(uint8_t rhport, uint8_t dev_addr, tusb_desc_interface_t const *i
 
 static bool xpadh_start(uint8_t dev_addr)
 {
-  memset(odata, 0, sizeof(odata));
+  xpadh_data_t * p_xpad = get_itf(dev_addr);
+  uint8_t * odata = p_xpad->odata;
 
-  if (xpad_ctype == XPAD_360_WIRED) {
+  memset(odata, 0, sizeof(p_xpad->odata));
+
+  if (p_xpad->ctype == XPAD_360_WIRED) {
     odata[3] = 0x40;
 
     if (tuh_xpad_send(dev_addr, odata, 12, false) == false) {
       TU_LOG2("xpadh_start() tuh_xpad_send error\r\n");
     }
-  } else if (xpad_ctype == XPAD_XBONE) {
+  } else if (p_xpad->ctype == XPAD_XBONE) {
     odata[0] = 0x05;
     odata[1] = 0x20;
-    odata[2] = serial++;
+    odata[2] = p_xpad->serial++;
     odata[3] = 0x01;
     odata[4] = 0x00;
 
@@ -195,9 +198,12 @@ static bool xpadh_start(uint8_t dev_addr)
 
 static bool xpadh_set_led(uint8_t dev_addr, uint8_t cmd)
 {
-  memset(odata, 0, sizeof(odata));
+  xpadh_data_t * p_xpad = get_itf(dev_addr);
+  uint8_t * odata = p_xpad->odata;
 
-  if (xpad_ctype == XPAD_360_WIRED) {
+  memset(odata, 0, sizeof(p_xpad->odata));
+
+  if (p_xpad->ctype == XPAD_360_WIRED) {
     odata[0] = 0x01;
     odata[1] = 0x03;
     odata[2] = cmd;
@@ -216,7 +222,7 @@ bool xpadh_set_config(uint8_t dev_addr, uint8_t itf_num)
 
   sleep_ms(100);
 
-  if (tuh_xpad_receive(dev_addr, idata, 32, false) == false) {
+  if (tuh_xpad_receive(dev_addr, get_itf(dev_addr)->idata, 32, false) == false) {
     TU_LOG2("tuh_xpad_receive error");
   }
 
@@ -227,6 +233,8 @@ bool xpadh_set_config(uint8_t dev_addr, uint8_t itf_num)
 
 bool tuh_xpad_write(uint8_t dev_addr, uint8_t *report, int size)
 {
+    uint8_t * odata = get_itf(dev_addr)->odata;
+
     memmove(odata, report, size);
 
     return tuh_xpad_send(dev_addr, odata, size, false);
@@ -234,6 +242,8 @@ bool tuh_xpad_write(uint8_t dev_addr, uint8_t *report, int size)
 
 bool tuh_xpad_vibro(uint8_t dev_addr, bool on)
 {
+    xpad_ctype_t xpad_ctype = get_itf(dev_addr)->ctype;
+
     if (on) {
         if (xpad_ctype == XPAD_360_WIRED) {
             uint8_t start_vibro[] = {
@@ -272,7 +282,11 @@ bool tuh_xpad_vibro(uint8_t dev_addr, bool on)
 
 bool xpadh_xfer_cb(uint8_t dev_addr, uint8_t ep_addr, xfer_result_t event, uint32_t xferred_bytes)
 {
-  if (ep_addr != xpadh_data[dev_addr-1].ep_out[0]) {
+  xpadh_data_t * p_xpad = get_itf(dev_addr);
+  xpad_ctype_t xpad_ctype = p_xpad->ctype;
+  uint8_t * idata = p_xpad->idata;
+
+  if (ep_addr != p_xpad->ep_out[0]) {
     if (xpad_ctype == XPAD_360_WIRED) {
       TU_LOG2_MEM(idata, xferred_bytes, 2);
       if (idata[0] == 0x01 && idata[1] == 0x03) {
@@ -290,7 +304,7 @@ bool xpadh_xfer_cb(uint8_t dev_addr, uint8_t ep_addr, xfer_result_t event, uint3
     }
   }
 
-  static xpad_controller_t old_info;
+  xpad_controller_t * old_info = &p_xpad->old_info;
   xpad_controller_t info;
   memset(&info, 0, sizeof(xpad_controller_t));
 
@@ -322,9 +336,9 @@ bool xpadh_xfer_cb(uint8_t dev_addr, uint8_t ep_addr, xfer_result_t event, uint3
 	info.rt = idata[5] << 2;
     }
 
-    if (memcmp(&info, &old_info, sizeof(xpad_controller_t))) {
+    if (memcmp(&info, old_info, sizeof(xpad_controller_t))) {
 	tuh_xpad_read_cb(dev_addr, idata, &info);
-	memmove(&old_info, &info, sizeof(xpad_controller_t));
+	memmove(old_info, &info, sizeof(xpad_controller_t));
     }
   } else if (xpad_ctype == XPAD_XBONE) {
     if (idata[0] == 0x20) {
@@ -351,12 +365,12 @@ bool xpadh_xfer_cb(uint8_t dev_addr, uint8_t ep_addr, xfer_result_t event, uint3
 	info.lt = (idata[7] << 8) | idata[6];
 	info.rt = (idata[9] << 8) | idata[8];
     } else if (idata[0] == 0x07 && idata[1] == 0x20) {
-        memmove(&info, &old_info, sizeof(xpad_controller_t));
+        memmove(&info, old_info, sizeof(xpad_controller_t));
 	if (idata[4] & 0x01) info.buttons |= XPAD_XLOGO; else info.buttons &= ~XPAD_XLOGO;
     }
 
     tuh_xpad_read_cb(dev_addr, idata, &info);
-    memmove(&old_info, &info, sizeof(xpad_controller_t));
+    memmove(old_info, &info, sizeof(xpad_controller_t));
   }
 
   tuh_xpad_receive(dev_addr, idata, 32, true); // waiting for next data
@@ -369,6 +383,11 @@ void xpadh_close(uint8_t dev_addr)
   TU_VERIFY(dev_addr <= CFG_TUH_DEVICE_MAX, );
 
   xpadh_data_t * p_xpad = get_itf(dev_addr);
+
+  if (tuh_xpad_mounted(dev_addr) && tuh_xpad_umount_cb) {
+    tuh_xpad_umount_cb(dev_addr);
+  }
+
   tu_memclr(p_xpad, sizeof(xpadh_data_t));
 }
 
@@ -146,6 +146,9 @@ void tuh_xpad_read_cb(uint8_t dev_addr, uint8_t *report, xpad_controller_t *info
 
 void tuh_xpad_mount_cb(uint8_t dev_addr);
 
+// Invoked when a device is unplugged
+TU_ATTR_WEAK void tuh_xpad_umount_cb(uint8_t dev_addr);
+
 bool tuh_xpad_write(uint8_t dev_addr, uint8_t *report, int size);
 
 bool tuh_xpad_vibro(uint8_t dev_addr, bool onoff);
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+#
+# Build the button map sector of the adapter from a text file, see button_map.h
+#
+#   button_map.py map.txt map.bin
+#   picotool load map.bin -t bin -o 0x10177000
+#
+# One rule per line, "source = n64 button", # starts a comment:
+#
+#   A = A
+#   X = Z
+#   LB = C_UP
+#   LT > 512 = C_LEFT
+#   RX < -16000 = C_LEFT
+#
+# Sources are the gamepad buttons below, or an axis compared with a
+# threshold (pressed above a positive one or below a negative one).
+
+import struct
+import sys
+
+MAGIC = 0x50414D42
+MAX_RULES = 64
+
+BUTTONS = {
+    'UP': 0, 'DOWN': 1, 'LEFT': 2, 'RIGHT': 3,
+    'START': 4, 'BACK': 5, 'L3': 6, 'R3': 7,
+    'LB': 8, 'RB': 9, 'XBOX': 10,
+    'A': 12, 'B': 13, 'X': 14, 'Y': 15,
+}
+
+AXES = {'LX': 16, 'LY': 17, 'RX': 18, 'RY': 19, 'LT': 20, 'RT': 21}
+
+N64_BUTTONS = {
+    'C_RIGHT': 0, 'C_LEFT': 1, 'C_DOWN': 2, 'C_UP': 3, 'R': 4, 'L': 5,
+    'D_RIGHT': 8, 'D_LEFT': 9, 'D_DOWN': 10, 'D_UP': 11,
+    'START': 12, 'Z': 13, 'B': 14, 'A': 15,
+}
+
+
+def n64_crc(data):
+    crc = 0
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x85) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+def parse_rule(line):
+    source, button = [s.strip().upper() for s in line.split('=')]
+
+    if button not in N64_BUTTONS:
+        raise ValueError('unknown N64 button %s' % button)
+
+    for op in ('>', '<'):
+        if op in source:
+            axis, threshold = [s.strip() for s in source.split(op)]
+            threshold = int(threshold, 0)
+            if axis not in AXES:
+                raise ValueError('unknown axis %s' % axis)
+            if (op == '>') != (threshold >= 0) or not -32768 <= threshold <= 32767:
+                raise ValueError('use > with a positive threshold, < with a negative one')
+            return AXES[axis], N64_BUTTONS[button], threshold
+
+    if source not in BUTTONS:
+        raise ValueError('unknown button %s' % source)
+
+    return BUTTONS[source], N64_BUTTONS[button], 0
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: %s map.txt map.bin' % sys.argv[0])
+
+    rules = b''
+    count = 0
+
+    with open(sys.argv[1]) as f:
+        for num, line in enumerate(f, 1):
+            line = line.split('#')[0].strip()
+            if not line:
+                continue
+            try:
+                rules += struct.pack('<BBh', *parse_rule(line))
+            except ValueError as e:
+                sys.exit('%s:%d: %s' % (sys.argv[1], num, e))
+            count += 1
+
+    if count > MAX_RULES:
+        sys.exit('more than %d rules' % MAX_RULES)
+
+    with open(sys.argv[2], 'wb') as f:
+        f.write(struct.pack('<IBBH', MAGIC, count, n64_crc(rules), 0) + rules)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,250 @@
+#!/usr/bin/env python3
+#
+# Build the gamepad database of the adapter from SDL's gamecontrollerdb.txt,
+# see gamepad_db.h
+#
+#   gamecontrollerdb.py gamecontrollerdb.txt gamepads.bin
+#   picotool load gamepads.bin -t bin -o 0x10157000
+#
+#   gamecontrollerdb.py --check
+#
+# Only USB gamepads are taken. The button and axis numbers of the Windows
+# mappings follow the HID report of the gamepad, Mac OS X mappings are used
+# for gamepads without one (--platform picks another first choice).
+
+import argparse
+import struct
+import sys
+
+MAGIC = 0x42444347
+DB_SIZE = 128 * 1024
+HEADER_SIZE = 12
+
+CONTROLS = [
+    'leftx', 'lefty', 'rightx', 'righty', 'lefttrigger', 'righttrigger',
+    'a', 'b', 'x', 'y', 'leftshoulder', 'rightshoulder',
+    'start', 'back', 'guide', 'leftstick', 'rightstick',
+    'dpup', 'dpdown', 'dpleft', 'dpright',
+]
+
+BUTTON = 0x00
+AXIS = 0x40
+HAT = 0x80
+NONE = 0xFF
+
+AXIS_INVERT = 0x10
+AXIS_HALF = 0x20
+
+USB_BUS = 0x0003
+
+
+def n64_crc(data):
+    crc = 0
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x85) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+def vid_pid(guid):
+    raw = bytes.fromhex(guid)
+
+    if len(raw) != 16:
+        return None
+
+    # old DirectInput GUIDs: vid, pid, then "PIDVID"
+    if raw[10:] == b'PIDVID':
+        return struct.unpack_from('<HH', raw, 0)
+
+    if struct.unpack_from('<H', raw, 0)[0] != USB_BUS:
+        return None
+
+    return struct.unpack_from('<H', raw, 4)[0], struct.unpack_from('<H', raw, 8)[0]
+
+
+def control(value):
+    flags = 0
+    invert = value.endswith('~')
+
+    if invert:
+        value = value[:-1]
+    if value[0] == '+':
+        flags |= AXIS_HALF
+        value = value[1:]
+    elif value[0] == '-':
+        flags |= AXIS_HALF | AXIS_INVERT
+        value = value[1:]
+    # ~ turns the axis around, a half axis included
+    if invert:
+        flags ^= AXIS_INVERT
+
+    if value[0] == 'b' and int(value[1:]) < AXIS:
+        return BUTTON | int(value[1:])
+    if value[0] == 'a' and int(value[1:]) < 16:
+        return AXIS | flags | int(value[1:])
+    if value[0] == 'h':
+        hat, mask = [int(v) for v in value[1:].split('.')]
+        if hat < 4 and mask in (1, 2, 4, 8):
+            return HAT | hat << 4 | mask
+
+    return NONE
+
+
+# (vid, pid), platform and controls of a mapping line, None if it can not be used
+def parse_line(line):
+    fields = line.split(',')
+    try:
+        key = vid_pid(fields[0])
+    except ValueError:
+        return None
+
+    if key is None:
+        return None
+
+    mapping = dict(field.split(':', 1) for field in fields[2:] if ':' in field)
+
+    try:
+        controls = [control(mapping[name]) if name in mapping else NONE for name in CONTROLS]
+    except (ValueError, IndexError):
+        return None
+
+    return key, mapping.get('platform'), controls
+
+
+def parse(path, platforms):
+    found = {}
+
+    with open(path, encoding='utf-8', errors='replace') as f:
+        for line in f:
+            line = line.strip()
+            if not line or line.startswith('#'):
+                continue
+
+            parsed = parse_line(line)
+            if parsed is None or parsed[1] not in platforms:
+                continue
+
+            key, platform, controls = parsed
+            rank = platforms.index(platform)
+            if key in found and found[key][0] <= rank:
+                continue
+
+            found[key] = (rank, controls)
+
+    return {key: controls for key, (rank, controls) in found.items()}
+
+
+# a hand-written line with every form of axis and the controls it has to give
+CHECK_LINE = ('030000005e0400008e02000000000000,Check pad,a:b0,b:b1,'
+              'leftx:a0,lefty:a1~,rightx:+a2,righty:+a2~,lefttrigger:-a3,righttrigger:-a3~,'
+              'dpup:h0.1,dpdown:h1.4,dpleft:-a4,dpright:+a4,platform:Windows,')
+CHECK_CONTROLS = {
+    'leftx': AXIS | 0,
+    'lefty': AXIS | AXIS_INVERT | 1,
+    'rightx': AXIS | AXIS_HALF | 2,
+    'righty': AXIS | AXIS_HALF | AXIS_INVERT | 2,
+    'lefttrigger': AXIS | AXIS_HALF | AXIS_INVERT | 3,
+    'righttrigger': AXIS | AXIS_HALF | 3,
+    'a': BUTTON | 0,
+    'b': BUTTON | 1,
+    'x': NONE,
+    'dpup': HAT | 0 << 4 | 1,
+    'dpdown': HAT | 1 << 4 | 4,
+    'dpleft': AXIS | AXIS_HALF | AXIS_INVERT | 4,
+    'dpright': AXIS | AXIS_HALF | 4,
+}
+
+
+def check():
+    key, platform, controls = parse_line(CHECK_LINE)
+    failed = 0
+
+    if key != (0x045E, 0x028E) or platform != 'Windows':
+        print('check line: %04x:%04x %s' % (key[0], key[1], platform))
+        failed += 1
+
+    for name, expected in CHECK_CONTROLS.items():
+        value = controls[CONTROLS.index(name)]
+        if value != expected:
+            print('%s: %02x, expected %02x' % (name, value, expected))
+            failed += 1
+
+    print('%d of %d checks failed' % (failed, len(CHECK_CONTROLS) + 1))
+    return failed == 0
+
+
+def db_hash(key, seed):
+    h = ((key ^ seed) * 0x9E3779B1) & 0xFFFFFFFF
+    return h ^ (h >> 15)
+
+
+def db_index(h, n):
+    return (h * n) >> 32
+
+
+# hash and displace: every bucket gets the first seed that sends its keys to free entries
+def perfect_hash(keys):
+    n = len(keys)
+    nbuckets = (n + 1) // 2
+    buckets = [[] for _ in range(nbuckets)]
+
+    for key in keys:
+        buckets[db_index(db_hash(key, 0), nbuckets)].append(key)
+
+    seeds = [0] * nbuckets
+    slots = [None] * n
+
+    for b in sorted(range(nbuckets), key=lambda b: -len(buckets[b])):
+        if not buckets[b]:
+            continue
+        for seed in range(1, 0x10000):
+            pos = [db_index(db_hash(key, seed), n) for key in buckets[b]]
+            if len(set(pos)) == len(pos) and all(slots[p] is None for p in pos):
+                break
+        else:
+            sys.exit('no perfect hash found')
+        seeds[b] = seed
+        for key, p in zip(buckets[b], pos):
+            slots[p] = key
+
+    return seeds, slots
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('db', nargs='?', help='gamecontrollerdb.txt')
+    parser.add_argument('out', nargs='?', help='flash image')
+    parser.add_argument('--platform', default='Windows')
+    parser.add_argument('--check', action='store_true', help='check the mapping parser and exit')
+    args = parser.parse_args()
+
+    if args.check:
+        sys.exit(0 if check() else 1)
+    if args.out is None:
+        parser.error('the db and out arguments are required')
+
+    platforms = [args.platform] + [p for p in ('Windows', 'Mac OS X') if p != args.platform]
+    gamepads = parse(args.db, platforms)
+
+    if not gamepads:
+        sys.exit('no USB gamepads found')
+
+    keys = [vid << 16 | pid for vid, pid in gamepads]
+    seeds, slots = perfect_hash(keys)
+
+    body = struct.pack('<%dH' % len(seeds), *seeds)
+    for key in slots:
+        body += struct.pack('<HH', key >> 16, key & 0xFFFF) + bytes(gamepads[(key >> 16, key & 0xFFFF)])
+
+    if HEADER_SIZE + len(body) > DB_SIZE:
+        sys.exit('%d gamepads do not fit in %d bytes' % (len(keys), DB_SIZE))
+
+    with open(args.out, 'wb') as f:
+        f.write(struct.pack('<IHHB3x', MAGIC, len(keys), len(seeds), n64_crc(body)) + body)
+
+    print('%d gamepads, %d bytes' % (len(keys), HEADER_SIZE + len(body)))
+
+
+if __name__ == '__main__':
+    main()